@@ -0,0 +1,159 @@
+// Runs traces against the editor core and reports latency. The terminal
+// is never touched: frames are built in memory and dropped.
+//
+// Traces are written by hand in the --script format rather than recorded
+// with --record, so they can be read, edited and diffed, and they do not
+// depend on the timing of the session they came from.
+//
+// Usage: bench lines trace...
+//
+// Prints one JSON object per line: the open time, p50/p99/max latency of
+// every trace, and the peak resident set size.
+
+#define NIM_NO_MAIN
+#include "../main.c"
+
+#include <sys/resource.h>
+
+struct ebench {
+    double *samples;
+    size_t count;
+    size_t cap;
+    struct timespec last;
+};
+
+struct ebench B;
+
+double elapsed_us(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+// Called after every operation: draws the frame the user would see and
+// records the time since the previous operation finished.
+void bench_step() {
+    struct abuf ab = ABUF_INIT;
+    scroll_screen();
+    draw_frame(&ab);
+    ab_free(&ab);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (B.count == B.cap) {
+        B.cap = B.cap ? B.cap * 2 : 1024;
+        B.samples = realloc(B.samples, B.cap * sizeof(double));
+    }
+
+    B.samples[B.count++] = elapsed_us(&B.last, &now);
+    clock_gettime(CLOCK_MONOTONIC, &B.last);
+}
+
+int compare_samples(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+double percentile(double p) {
+    size_t i = (size_t) (p * (B.count - 1) + 0.5);
+
+    return B.samples[i];
+}
+
+void generate_file(char *path, size_t lines) {
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL) {
+        die("fopen");
+    }
+
+    for (size_t i = 0; i < lines; i++) {
+        switch (i % 8) {
+            case 0: fprintf(fp, "/* block %ld\n", i); break;
+            case 1: fprintf(fp, "   ends here */\n"); break;
+            case 2: fprintf(fp, "int v%ld = %ld; // counter\n", i, i * 7); break;
+            case 3: fprintf(fp, "\tchar *s%ld = \"string %ld\";\n", i, i); break;
+            case 4: fprintf(fp, "\tif (v%ld > 0) {\n", i - 2); break;
+            case 5: fprintf(fp, "\t\treturn v%ld;\n", i - 3); break;
+            case 6: fprintf(fp, "\t}\n"); break;
+            case 7: fprintf(fp, "\n"); break;
+        }
+    }
+
+    fclose(fp);
+}
+
+void remove_sidecars(char *path) {
+    char *index = sidecar_path(path, "nimi");
+    char *journal = sidecar_path(path, "nimj");
+
+    unlink(index);
+    unlink(journal);
+    free(index);
+    free(journal);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: bench lines trace...\n");
+        return 1;
+    }
+
+    size_t lines = strtoul(argv[1], NULL, 10);
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/nim-bench-%ld.c", lines);
+
+    generate_file(path, lines);
+    remove_sidecars(path);
+
+    init();
+    S.w = 80;
+    S.h = 22;
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    open_file(path);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    E.journal.enabled = true;
+    E.undo.enabled = true;
+
+    printf("{\"lines\": %ld, \"op\": \"open\", \"ms\": %.3f}\n", lines,
+            elapsed_us(&start, &end) / 1e3);
+
+    for (int i = 2; i < argc; i++) {
+        char *name = strrchr(argv[i], '/');
+        name = name ? name + 1 : argv[i];
+
+        size_t len = strcspn(name, ".");
+        B.count = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &B.last);
+        size_t ops = run_script(argv[i], bench_step);
+        finish_save(true);
+
+        if (B.count == 0) {
+            continue;
+        }
+
+        qsort(B.samples, B.count, sizeof(double), compare_samples);
+
+        printf("{\"lines\": %ld, \"trace\": \"%.*s\", \"ops\": %ld, "
+                "\"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}\n",
+                lines, (int) len, name, ops,
+                percentile(0.50), percentile(0.99), B.samples[B.count - 1]);
+        fflush(stdout);
+    }
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("{\"lines\": %ld, \"peak_rss_kb\": %ld}\n", lines, ru.ru_maxrss);
+
+    journal_close(true);
+    remove_sidecars(path);
+    unlink(path);
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+// Scans row metadata the way whole-buffer operations do: renumbering,
+// summing lengths and following the comment state. The editor keeps the
+// length and comment state of every row in the dense E.lens and
+// E.comments arrays; the layout they replaced is rebuilt from the same
+// rows for comparison.
+//
+// Usage: scan [lines]
+
+#define NIM_NO_MAIN
+#include "../main.c"
+
+#define SCAN_LINES 1000000
+#define SCAN_ROUNDS 5
+
+// The row layout before the hot metadata moved out of struct erow.
+struct arow {
+    size_t idx;
+    bool comment;
+    bool mapped;
+    uint32_t snap;
+    uint64_t used;
+    char *chars;
+    size_t len;
+    char *render;
+    size_t rlen;
+    void *spans;
+    size_t nspans;
+};
+
+volatile size_t sink;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(char *layout, char *scan, double elapsed, size_t lines) {
+    printf("{\"layout\": \"%s\", \"scan\": \"%s\", \"rows\": %zu, \"mrows_per_s\": %.1f}\n",
+            layout, scan, lines, lines / elapsed / 1e6);
+}
+
+// Loads rows of 0 to 96 bytes into the buffer, with a comment opened
+// every thousand rows.
+void fill_buffer(size_t lines) {
+    size_t size = 0;
+
+    for (size_t i = 0; i < lines; i++) {
+        size += i % 97 + 1;
+    }
+
+    char *buf = malloc(size + 1);
+    char *p = buf;
+
+    for (size_t i = 0; i < lines; i++) {
+        memset(p, 'x', i % 97);
+        p += i % 97;
+        *p++ = '\n';
+    }
+
+    append_bytes(buf, size);
+    free(buf);
+
+    for (size_t i = 0; i < E.lines; i++) {
+        E.comments[i] = (i % 1000) < 10;
+    }
+}
+
+void bench_aos() {
+    size_t lines = E.lines;
+    struct arow *rows = calloc(lines, sizeof(struct arow));
+    double best[3] = { 1e9, 1e9, 1e9 };
+
+    for (size_t i = 0; i < lines; i++) {
+        rows[i].idx = i;
+        rows[i].chars = E.rows[i].chars;
+        rows[i].len = E.lens[i];
+        rows[i].comment = E.comments[i];
+    }
+
+    for (size_t round = 0; round < SCAN_ROUNDS; round++) {
+        // Renumbering after a row is inserted at the top.
+        double start = now();
+
+        for (size_t i = 0; i < lines; i++) {
+            rows[i].idx++;
+        }
+
+        double t = now() - start;
+        best[0] = (t < best[0]) ? t : best[0];
+
+        start = now();
+        size_t size = 0;
+
+        for (size_t i = 0; i < lines; i++) {
+            size += rows[i].len + 1;
+        }
+
+        sink = size;
+        t = now() - start;
+        best[1] = (t < best[1]) ? t : best[1];
+
+        // Following the comment state down the buffer.
+        start = now();
+        size_t changes = 0;
+
+        for (size_t i = 1; i < lines; i++) {
+            changes += (rows[i].comment != rows[i - 1].comment);
+        }
+
+        sink = changes;
+        t = now() - start;
+        best[2] = (t < best[2]) ? t : best[2];
+    }
+
+    report("aos", "renumber", best[0], lines);
+    report("aos", "length", best[1], lines);
+    report("aos", "comment", best[2], lines);
+
+    free(rows);
+}
+
+void bench_soa() {
+    size_t lines = E.lines;
+    double best[2] = { 1e9, 1e9 };
+
+    for (size_t round = 0; round < SCAN_ROUNDS; round++) {
+        double start = now();
+        size_t size = 0;
+
+        for (size_t i = 0; i < lines; i++) {
+            size += E.lens[i] + 1;
+        }
+
+        sink = size;
+        double t = now() - start;
+        best[0] = (t < best[0]) ? t : best[0];
+
+        start = now();
+        size_t changes = 0;
+
+        for (size_t i = 1; i < lines; i++) {
+            changes += (E.comments[i] != E.comments[i - 1]);
+        }
+
+        sink = changes;
+        t = now() - start;
+        best[1] = (t < best[1]) ? t : best[1];
+    }
+
+    // Rows no longer store their index, so there is nothing to renumber.
+    report("soa", "length", best[0], lines);
+    report("soa", "comment", best[1], lines);
+}
+
+int main(int argc, char **argv) {
+    size_t lines = (argc > 1) ? strtoul(argv[1], NULL, 10) : SCAN_LINES;
+
+    init();
+    S.headless = true;
+    fill_buffer(lines);
+
+    bench_aos();
+    bench_soa();
+
+    return 0;
+}
@@ -7,16 +7,30 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -25,16 +39,60 @@
 #define NIM_QUIT_TIMES 3
 #define NIM_TAB_STOP 4
 #define NIM_NUMLINES true
+#define NIM_FSYNC true
+#define NIM_IOV_BATCH 512
+#define NIM_JOURNAL_BATCH 4096
+#define NIM_JOURNAL_DELAY 1
+#define NIM_JOURNAL_MAGIC "NIMJ"
+#define NIM_JOURNAL_VERSION 1
+#define NIM_UNDO_LIMIT (64 * 1024 * 1024)
+#define NIM_READ_CHUNK (1024 * 1024)
+#define NIM_FOLLOW_BURST (16 * 1024 * 1024)
+#define NIM_STREAM_LIMIT (16 * 1024 * 1024)
+#define NIM_INDEX_MIN (1024 * 1024)
+#define NIM_INDEX_MAGIC "NIMI"
+#define NIM_INDEX_VERSION 1
+#define NIM_INDEX_SAMPLES 64
+#define NIM_INDEX_BLOCK 4096
+#define NIM_PACK_ROWS 512
+#define NIM_PACK_MARGIN 4096
+#define NIM_PACK_SLICE 5
+#define NIM_LZ_HASH 12
+#define NIM_HUD_FRAMES 128
+#define NIM_PROFILE_EVENTS (1 << 20)
+#define NIM_MAX_WORKERS 64
+#define NIM_FILTER_PARALLEL 65536
+#define NIM_GREP_LINE 256
+#define NIM_BINARY_PROBE 4096
+#define NIM_HEX_WIDTH 16
+#define NIM_WATCH_INTERVAL 1
+#define NIM_WATCH_BLOCK (1024 * 1024)
+#define NIM_SORT_PARALLEL 65536
+#define NIM_SORT_SMALL 16
+#define NIM_LRU_SHIFTS 64
 
 #define HL_NUMBERS (1 << 0)
 #define HL_STRINGS (1 << 1)
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define ABUF_INIT { NULL, 0 }
+#define PROFILE(probe, phase) do { if (S.profile.events) profile_event(probe, phase); } while (0)
 
 void set_message(const char *fmt, ...);
 void refresh_screen();
+bool poll_tasks();
+void poll_background();
+void journal_flush();
+void journal_close(bool discard);
+int32_t open_temp_file(char *path, char **tmp);
+bool finish_save(bool wait);
+void resize_screen();
 char *prompt(char *message, void (*callback)(char *, uint16_t));
+void filter_update(size_t y);
+void init_buffer();
+void close_buffers();
+bool apply_command(char *name, size_t lo, size_t hi);
+bool poll_grep();
 
 enum ekey {
     ENTER = '\r',
@@ -74,33 +132,439 @@ enum ehl {
     HL_MATCH,
 };
 
+struct espan {
+    uint32_t start;
+    uint32_t len;
+    uint8_t hl;
+};
+
+// A grapheme cluster of a row with multibyte text: where it starts in
+// chars and render, and the screen column it is drawn at.
+struct ecell {
+    uint32_t x;
+    uint32_t r;
+    uint32_t rx;
+};
+
+struct erange {
+    uint32_t first;
+    uint32_t last;
+};
+
+struct eblock;
+
+// Per-row buffers. The length and comment state of each row live in the
+// dense E.lens and E.comments arrays, so whole-buffer walks stay in cache.
 struct erow {
-    size_t idx;
-    bool comment;
+    bool mapped;
+    uint32_t snap;
+    uint64_t used;
     char *chars;
-    size_t len;
     char *render;
     size_t rlen;
-    uint8_t *hl;
+    struct espan *spans;
+    size_t nspans;
+    struct ecell *cells;
+    size_t ncells;
+    struct eblock *block;
+};
+
+// The compressed text of a run of adjacent rows.
+struct eblock {
+    char *data;
+    size_t size;
+    size_t raw;
+    size_t lines;
+};
+
+struct etrace {
+    FILE *out;
+    FILE *in;
+    char *path;
+    bool realtime;
+    uint64_t start;
+    size_t keys;
+    size_t frames;
+    uint64_t slowest;
+    size_t slowest_key;
+};
+
+struct ewrap {
+    bool enabled;
+    uint16_t width;
+    uint8_t stamp;
+    uint32_t *counts;
+    uint8_t *stamps;
+    size_t *tree;
+    size_t dirty;
+    size_t lineoff;
+    size_t cy;
+    size_t cx;
+};
+
+// Rows shown while filtering: those that matched the pattern, and those
+// edited since, in order.
+struct efilter {
+    bool active;
+    char *pattern;
+    size_t plen;
+    size_t *rows;
+    size_t count;
+    size_t cap;
+    size_t cy;
+};
+
+// A read-only view of the file on disk, NIM_HEX_WIDTH bytes per row. Rows
+// are formatted from the mapping as they are drawn.
+struct ehex {
+    bool active;
+    bool binary;
+    char *map;
+    size_t size;
+    uint8_t digits;
+    size_t pos;
+    size_t rowoff;
+};
+
+// Hashes the blocks of a file that was read in the background, through
+// its own descriptor, and only keeps them if the file did not change.
+struct ewatch_hasher {
+    pthread_t thread;
+    int32_t fd;
+    size_t size;
+    struct timespec mtime;
+    uint64_t *blocks;
+    size_t nblocks;
+    bool ok;
+    atomic_bool cancel;
+    atomic_bool done;
+};
+
+// The file on disk as it was last read or written, with a sampled hash
+// of it and the hash of every NIM_WATCH_BLOCK bytes. Saves hash the
+// blocks as they write them and reads leave it to the hasher, so until
+// it is done, blocks is NULL unless the file is empty.
+struct ewatch {
+    dev_t dev;
+    ino_t ino;
+    size_t size;
+    struct timespec mtime;
+    uint64_t hash;
+    uint64_t *blocks;
+    size_t nblocks;
+    struct ewatch_hasher *hasher;
+    time_t checked;
+    bool warned;
+};
+
+// Hashes a stream in blocks, each block the same as hash_words of it,
+// so a save can hash the rows while it writes them.
+struct ewatch_stream {
+    uint64_t *blocks;
+    size_t nblocks;
+    uint64_t hash;
+    size_t pos;
+    char word[8];
+    size_t nword;
+};
+
+struct ewatch_job {
+    pthread_t thread;
+    bool started;
+    const char *map;
+    size_t limit;
+    size_t lo;
+    size_t hi;
+    uint64_t *hashes;
+};
+
+// Rows are sorted through keys: the first bytes of the row packed
+// big-endian, so most comparisons never touch the row text.
+struct esort_key {
+    uint64_t prefix;
+    size_t idx;
+};
+
+struct esort_job {
+    pthread_t thread;
+    bool started;
+    struct esort_key *keys;
+    struct esort_key *tmp;
+    size_t lo;
+    size_t mid;
+    size_t hi;
+};
+
+struct esort_group {
+    size_t start;
+    size_t count;
+};
+
+struct efilter_job {
+    pthread_t thread;
+    bool started;
+    size_t lo;
+    size_t hi;
+    size_t *rows;
+    size_t count;
+    size_t cap;
+};
+
+struct eoutput {
+    int32_t fd;
+    char *buf;
+    size_t len;
+    size_t off;
+    bool stale;
+};
+
+struct ehud {
+    bool active;
+    uint64_t frames[NIM_HUD_FRAMES];
+    size_t nframes;
+    size_t head;
+    size_t bytes;
+    uint64_t syntax_us;
+    size_t syntax_rows;
+    uint64_t edit_us;
+    size_t edit_rows;
+};
+
+enum eprobe {
+    P_READ_KEY,
+    P_PROCESS_KEY,
+    P_UPDATE_ROW,
+    P_UPDATE_SYNTAX,
+    P_DRAW_LINES,
+    P_FIND,
+    P_SAVE_FILE,
+};
+
+char *probe_names[] = {
+    "read_key", "process_key", "update_row", "update_syntax",
+    "draw_lines", "find", "save_file",
+};
+
+struct eevent {
+    uint64_t ns;
+    uint8_t probe;
+    char phase;
+};
+
+struct eprofile {
+    struct eevent *events;
+    size_t head;
+    size_t count;
+    char *path;
+};
+
+struct epack {
+    bool enabled;
+    bool idle;
+    bool trim;
+    size_t next;
+    size_t rowoff;
+    size_t size;
+    size_t raw;
+};
+
+// Seen is the number of row shifts already applied to idx.
+struct elru_entry {
+    size_t idx;
+    uint64_t stamp;
+    uint64_t seen;
+};
+
+struct elru_shift {
+    size_t at;
+    ssize_t delta;
+};
+
+// Row shifts are logged and applied to an entry only when it leaves the
+// queue; the whole queue is rewritten once every NIM_LRU_SHIFTS shifts.
+struct elru {
+    struct elru_entry *entries;
+    size_t head;
+    size_t count;
+    size_t cap;
+    struct elru_shift shifts[NIM_LRU_SHIFTS];
+    size_t nshifts;
+    uint64_t base;
+    size_t budget;
+    size_t resident;
+    uint64_t tick;
+    uint64_t frame;
+    uint64_t drawn;
+};
+
+struct ematch {
+    bool active;
+    size_t row;
+    size_t start;
+    size_t len;
+};
+
+struct eslice {
+    char *chars;
+    size_t len;
+};
+
+// A packed run of rows in the snapshot, starting at row at.
+struct esave_block {
+    size_t at;
+    struct eblock *block;
+};
+
+struct esave {
+    bool active;
+    uint32_t id;
+    pthread_t thread;
+    struct eslice *rows;
+    size_t lines;
+    struct esave_block *packed;
+    size_t npacked;
+    size_t size;
+    struct ewatch_stream hashes;
+    uint64_t changes;
+    char *path;
+    char *tmp;
+    int32_t fd;
+    int32_t error;
+    atomic_size_t written;
+    atomic_bool done;
+    char **orphans;
+    size_t norphans;
+};
+
+enum ejop {
+    J_INSERT_ROW = 1,
+    J_DELETE_ROW,
+    J_INSERT_CHAR,
+    J_DELETE_CHAR,
+    J_APPEND,
+    J_TRUNCATE,
+    J_INSERT_STRING,
+    J_DELETE_STRING,
+    J_COMMAND,
+};
+
+struct ejheader {
+    char magic[4];
+    uint32_t version;
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+};
+
+struct ejournal {
+    bool enabled;
+    bool stale;
+    int32_t fd;
+    char *path;
+    size_t size;
+    size_t mark;
+    char *buf;
+    size_t len;
+    size_t cap;
+    time_t flushed;
+};
+
+struct eundo_rec {
+    uint8_t op;
+    uint64_t group;
+    size_t row;
+    size_t at;
+    size_t len;
+    size_t cx;
+    size_t cy;
+    size_t ax;
+    size_t ay;
+    size_t start;
+    char *data;
+};
+
+struct eiheader {
+    char magic[4];
+    uint32_t version;
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    uint64_t hash;
+    uint64_t lines;
+    uint32_t syntax;
+    uint32_t partial;
+};
+
+struct efollow {
+    bool active;
+    bool pending;
+    int32_t fd;
+    int32_t file;
+    size_t offset;
 };
 
+struct estream {
+    bool active;
+    int32_t fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t drained;
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool eof;
+    int32_t error;
+    size_t total;
+};
+
+struct eundo {
+    bool enabled;
+    bool applying;
+    bool fresh;
+    char *buf;
+    size_t size;
+    size_t cap;
+    size_t pos;
+    size_t limit;
+    uint64_t group;
+    size_t cx;
+    size_t cy;
+};
+
+// One buffer: a file, its rows and everything derived from them. Every
+// buffer is allocated once in S.buffers; E is the one being edited.
 struct econfig {
     size_t x;
     size_t y;
     uint8_t gw;
     size_t rx;
-    uint16_t w;
-    uint16_t h;
     char *filename;
     bool dirty;
+    uint64_t changes;
     struct erow *rows;
+    size_t *lens;
+    bool *comments;
     size_t lines;
+    size_t capacity;
+    size_t partial;
+    char *map;
+    size_t mapsize;
     size_t rowoff;
     size_t coloff;
-    char message[80];
-    time_t timestamp;
     struct esyntax *syntax;
-    struct termios terminal;
+    struct esave save;
+    struct ejournal journal;
+    struct eundo undo;
+    struct efollow follow;
+    struct estream stream;
+    struct elru lru;
+    struct ematch match;
+    struct ewrap wrap;
+    struct efilter filter;
+    bool results;
+    struct ehex hex;
+    struct ewatch watch;
+    struct epack pack;
 };
 
 struct abuf {
@@ -108,7 +572,60 @@ struct abuf {
     size_t size;
 };
 
-struct econfig E;
+// A search through the files below the working directory. One thread
+// lists the files, the workers search them, and the results wait in out
+// until the results buffer is current.
+struct egrep {
+    bool active;
+    bool regex;
+    char *pattern;
+    size_t plen;
+    size_t buffer;
+    pthread_t walker;
+    pthread_t workers[NIM_MAX_WORKERS];
+    size_t nworkers;
+    size_t running;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    char **paths;
+    size_t npaths;
+    size_t cap;
+    size_t next;
+    bool walked;
+    struct abuf out;
+    size_t files;
+    size_t matches;
+    uint64_t start;
+    uint64_t finish;
+};
+
+// State shared by every buffer: the terminal, the message line and the
+// recorders.
+struct esession {
+    uint16_t w;
+    uint16_t h;
+    char message[80];
+    time_t timestamp;
+    struct econfig **buffers;
+    size_t nbuffers;
+    size_t current;
+    struct etrace trace;
+    struct eoutput output;
+    struct ehud hud;
+    struct eprofile profile;
+    struct egrep grep;
+    bool headless;
+    struct termios terminal;
+};
+
+struct econfig *E_buffer;
+struct esession S;
+
+#define E (*E_buffer)
+
+volatile sig_atomic_t E_signal = 0;
+volatile sig_atomic_t E_resized = 0;
+volatile sig_atomic_t E_faulted = 0;
 
 char *C_extensions[] = { ".c", ".h", NULL };
 
@@ -137,32 +654,83 @@ struct esyntax HLDB[] = {
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+// Writes as much of the pending frame as the terminal takes without
+// blocking. A frame the terminal refuses outright is dropped, like the
+// unchecked writes before it.
+bool flush_output() {
+    struct eoutput *o = &S.output;
+
+    while (o->off < o->len) {
+        ssize_t num = write(o->fd, &o->buf[o->off], o->len - o->off);
+
+        if (num == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (num == -1 && errno == EAGAIN) {
+            return false;
+        }
+
+        if (num == -1) {
+            break;
+        }
+
+        o->off += num;
+    }
+
+    free(o->buf);
+    o->buf = NULL;
+    o->len = 0;
+    o->off = 0;
+
+    return true;
+}
+
+// Waits for the pending frame to go out before anything else is written,
+// giving up on a terminal that stops reading.
+void drain_output() {
+    struct pollfd pfd = { S.output.fd, POLLOUT, 0 };
+
+    while (!flush_output()) {
+        if (poll(&pfd, 1, 1000) <= 0) {
+            break;
+        }
+    }
+}
+
 void clear_screen() {
+    drain_output();
     write(STDOUT_FILENO, "\x1b[2J\x1b[H", 7);
 }
 
 void die(const char *s) {
-    clear_screen();
+    journal_flush();
+
+    if (!S.headless) {
+        clear_screen();
+    }
+
     perror(s);
     exit(1);
 }
 
 void restore_terminal() {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.terminal) == -1) {
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &S.terminal) == -1) {
         die("tcsetattr");
     }
 
+    drain_output();
     write(STDIN_FILENO, "\x1b[?1049l", 8);
 }
 
 void enable_raw_mode() {
-    if (tcgetattr(STDIN_FILENO, &E.terminal) == -1) {
+    if (tcgetattr(STDIN_FILENO, &S.terminal) == -1) {
         die("tcgetattr");
     }
 
     atexit(restore_terminal);
 
-    struct termios raw = E.terminal;
+    struct termios raw = S.terminal;
     raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
     raw.c_oflag &= ~OPOST;
     raw.c_cflag |= CS8;
@@ -177,18 +745,119 @@ void enable_raw_mode() {
     write(STDIN_FILENO, "\x1b[?1049h", 8);
 }
 
-uint16_t read_key() {
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t now_us() {
+    return now_ns() / 1000;
+}
+
+// Events go into a ring buffer that keeps the most recent ones; it is only
+// written out when the editor exits.
+void profile_event(uint8_t probe, char phase) {
+    struct eprofile *p = &S.profile;
+    struct eevent *event = &p->events[(p->head + p->count) % NIM_PROFILE_EVENTS];
+
+    if (p->count == NIM_PROFILE_EVENTS) {
+        p->head = (p->head + 1) % NIM_PROFILE_EVENTS;
+    } else {
+        p->count++;
+    }
+
+    event->ns = now_ns();
+    event->probe = probe;
+    event->phase = phase;
+}
+
+// Writes the events in the Chrome trace event format. Ends whose begin
+// was overwritten are dropped.
+void profile_dump() {
+    struct eprofile *p = &S.profile;
+    FILE *fp = fopen(p->path, "w");
+
+    if (fp == NULL) {
+        return;
+    }
+
+    size_t open[sizeof(probe_names) / sizeof(probe_names[0])] = { 0 };
+    bool first = true;
+
+    fprintf(fp, "{\"traceEvents\": [\n");
+
+    for (size_t i = 0; i < p->count; i++) {
+        struct eevent *event = &p->events[(p->head + i) % NIM_PROFILE_EVENTS];
+
+        if (event->phase == 'E' && open[event->probe] == 0) {
+            continue;
+        }
+
+        open[event->probe] += (event->phase == 'B') ? 1 : -1;
+
+        fprintf(fp, "%s{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %" PRIu64 ".%03" PRIu64 ", \"pid\": 1, \"tid\": 1}",
+                first ? "" : ",\n", probe_names[event->probe], event->phase,
+                event->ns / 1000, event->ns % 1000);
+        first = false;
+    }
+
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+void start_profile(char *path) {
+    S.profile.events = malloc(NIM_PROFILE_EVENTS * sizeof(struct eevent));
+    S.profile.path = path;
+    atexit(profile_dump);
+}
+
+uint16_t read_terminal_key() {
     char c;
 
     while (true) {
-        ssize_t num = read(STDIN_FILENO, &c, 1);
+        // Wait for input and, while a frame is only partly written, for the
+        // terminal to take more of it.
+        struct pollfd fds[2] = {
+            { STDIN_FILENO, POLLIN, 0 },
+            { S.output.fd, POLLOUT, 0 },
+        };
+        int ready = poll(fds, (S.output.len > 0) ? 2 : 1, 100);
+
+        if (ready > 0 && (fds[1].revents & (POLLOUT | POLLERR)) &&
+                flush_output() && S.output.stale) {
+            refresh_screen();
+        }
 
-        if (num == 1) {
-            break;
+        if (ready > 0 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t num = read(STDIN_FILENO, &c, 1);
+
+            if (num == 1) {
+                break;
+            }
+
+            if (num == -1 && errno != EAGAIN && errno != EINTR) {
+                die("read");
+            }
+        }
+
+        if (E_signal) {
+            die("signal");
+        }
+
+        if (E_resized) {
+            E_resized = 0;
+            resize_screen();
+            refresh_screen();
         }
 
-        if (num == -1 && errno != EAGAIN) {
-            die("read");
+        if (ready == -1 && errno != EINTR) {
+            die("poll");
+        }
+
+        if (ready == 0 && poll_tasks()) {
+            refresh_screen();
         }
     }
 
@@ -240,6 +909,125 @@ uint16_t read_key() {
         return ESCAPE;
     }
 
+    return (uint8_t) c;
+}
+
+// Trace files are text: a "nim-trace" header with the window size, then a
+// "k <us> <key>" line for every key and an "f <us>" line with the time
+// taken by every frame. A replay writes the same format to <trace>.replay.
+void start_recording(char *path) {
+    S.trace.out = fopen(path, "w");
+
+    if (S.trace.out == NULL) {
+        die("fopen");
+    }
+
+    fprintf(S.trace.out, "nim-trace 1 %d %d\n", S.h + 2, S.w);
+    S.trace.start = now_us();
+}
+
+void start_replay(char *path) {
+    int rows;
+    int cols;
+
+    S.trace.in = fopen(path, "r");
+
+    if (S.trace.in == NULL) {
+        die("fopen");
+    }
+
+    if (fscanf(S.trace.in, "nim-trace 1 %d %d\n", &rows, &cols) != 2 || rows < 3 || cols < 1) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        exit(1);
+    }
+
+    S.h = rows - 2;
+    S.w = cols;
+
+    size_t len = strlen(path);
+    S.trace.path = malloc(len + 8);
+    snprintf(S.trace.path, len + 8, "%s.replay", path);
+    start_recording(S.trace.path);
+}
+
+void record_key(uint16_t c) {
+    fprintf(S.trace.out, "k %" PRIu64 " %d\n", now_us() - S.trace.start, c);
+    S.trace.keys++;
+}
+
+void record_frame(uint64_t us) {
+    fprintf(S.trace.out, "f %" PRIu64 "\n", us);
+    S.trace.frames++;
+
+    if (us > S.trace.slowest) {
+        S.trace.slowest = us;
+        S.trace.slowest_key = S.trace.keys;
+    }
+}
+
+void finish_trace() {
+    if (S.trace.out == NULL) {
+        return;
+    }
+
+    fclose(S.trace.out);
+    S.trace.out = NULL;
+
+    fprintf(stderr, "%ld keys, %ld frames, slowest frame %.3f ms after key %ld\n",
+            S.trace.keys, S.trace.frames, S.trace.slowest / 1000.0, S.trace.slowest_key);
+
+    if (S.trace.path) {
+        fprintf(stderr, "Frame times written to %s\n", S.trace.path);
+    }
+}
+
+// Returns the next key of the trace, waiting for its original time if
+// asked to. At the end of the trace the editor exits.
+uint16_t replay_key() {
+    char type;
+    uint64_t at;
+    int c;
+
+    while (fscanf(S.trace.in, " %c %" SCNu64, &type, &at) == 2) {
+        if (type != 'k') {
+            continue;
+        }
+
+        if (fscanf(S.trace.in, " %d", &c) != 1) {
+            break;
+        }
+
+        while (S.trace.realtime && now_us() - S.trace.start < at) {
+            uint64_t wait = at - (now_us() - S.trace.start);
+            usleep(wait < 100000 ? wait : 100000);
+
+            if (poll_tasks()) {
+                refresh_screen();
+            }
+        }
+
+        if (poll_tasks()) {
+            refresh_screen();
+        }
+
+        return c;
+    }
+
+    close_buffers();
+    clear_screen();
+    exit(0);
+}
+
+uint16_t read_key() {
+    PROFILE(P_READ_KEY, 'B');
+    uint16_t c = S.trace.in ? replay_key() : read_terminal_key();
+
+    if (S.trace.out) {
+        record_key(c);
+    }
+
+    PROFILE(P_READ_KEY, 'E');
+
     return c;
 }
 
@@ -302,54 +1090,103 @@ void update_gutter() {
         E.gw++;
     }
 
-    E.w -= (E.gw - old_gw);
+    S.w -= (E.gw - old_gw);
 }
 
 bool is_separator(uint16_t c) {
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void update_syntax(struct erow *row) {
-    row->hl = realloc(row->hl, row->rlen);
-    memset(row->hl, HL_NORMAL, row->rlen);
+size_t derived_size(struct erow *row) {
+    return (row->render ? row->rlen + 1 : 0) + row->nspans * sizeof(struct espan)
+        + row->ncells * sizeof(struct ecell);
+}
 
-    if (E.syntax == NULL) {
-        return;
+void set_spans(struct erow *row, uint8_t *hl) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < row->rlen; i++) {
+        if (hl[i] != HL_NORMAL && (i == 0 || hl[i] != hl[i - 1])) {
+            count++;
+        }
     }
 
-    char *cm = E.syntax->comment;
-    char *mcs = E.syntax->mlcomment_start;
-    char *mce = E.syntax->mlcomment_end;
+    E.lru.resident -= row->nspans * sizeof(struct espan);
+    E.lru.resident += count * sizeof(struct espan);
 
-    size_t cmlen = cm ? strlen(cm) : 0;
-    size_t mcslen = mcs ? strlen(mcs) : 0;
-    size_t mcelen = mce ? strlen(mce) : 0;
+    if (count != row->nspans) {
+        free(row->spans);
+        row->spans = count ? malloc(count * sizeof(struct espan)) : NULL;
+        row->nspans = count;
+    }
 
-    char **keywords = E.syntax->keywords;
+    size_t n = 0;
 
-    bool after_sep = true;
-    char in_string = '\0';
-    bool in_comment = (row->idx > 0 && E.rows[row->idx - 1].comment);
+    for (size_t i = 0; i < row->rlen; i++) {
+        if (hl[i] == HL_NORMAL) {
+            continue;
+        }
+
+        if (i > 0 && hl[i] == hl[i - 1]) {
+            row->spans[n - 1].len++;
+        } else {
+            row->spans[n++] = (struct espan) { i, 1, hl[i] };
+        }
+    }
+}
+
+// Works on one class per byte in a scratch buffer, then keeps only the
+// runs that are not HL_NORMAL.
+bool highlight_row(size_t y) {
+    struct erow *row = &E.rows[y];
+    static uint8_t *hl = NULL;
+    static size_t size = 0;
+
+    if (row->rlen > size) {
+        size = row->rlen;
+        hl = realloc(hl, size);
+    }
+
+    memset(hl, HL_NORMAL, row->rlen);
+
+    if (E.syntax == NULL) {
+        set_spans(row, hl);
+        return false;
+    }
+
+    char *cm = E.syntax->comment;
+    char *mcs = E.syntax->mlcomment_start;
+    char *mce = E.syntax->mlcomment_end;
+
+    size_t cmlen = cm ? strlen(cm) : 0;
+    size_t mcslen = mcs ? strlen(mcs) : 0;
+    size_t mcelen = mce ? strlen(mce) : 0;
+
+    char **keywords = E.syntax->keywords;
+
+    bool after_sep = true;
+    char in_string = '\0';
+    bool in_comment = (y > 0 && E.comments[y - 1]);
 
     size_t i = 0;
 
     while (i < row->rlen) {
         char c = row->render[i];
-        uint8_t prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+        uint8_t prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
 
         if (cmlen && !in_string && !in_comment) {
             if (!strncmp(&row->render[i], cm, cmlen)) {
-                memset(&row->hl[i], HL_COMMENT, row->rlen - i);
+                memset(&hl[i], HL_COMMENT, row->rlen - i);
                 break;
             }
         }
 
         if (mcslen && mcelen && !in_string) {
             if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
+                hl[i] = HL_MLCOMMENT;
 
                 if (!strncmp(&row->render[i], mce, mcelen)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mcelen);
+                    memset(&hl[i], HL_MLCOMMENT, mcelen);
                     i += mcelen;
                     in_comment = false;
                     after_sep = true;
@@ -359,7 +1196,7 @@ void update_syntax(struct erow *row) {
                     continue;
                 }
             } else if (!strncmp(&row->render[i], mcs, mcslen)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcslen);
+                memset(&hl[i], HL_MLCOMMENT, mcslen);
                 i += mcslen;
                 in_comment = true;
                 continue;
@@ -368,10 +1205,10 @@ void update_syntax(struct erow *row) {
 
         if (E.syntax->flags & HL_STRINGS) {
             if (in_string) {
-                row->hl[i] = HL_STRING;
+                hl[i] = HL_STRING;
 
                 if (c == '\\' && i + 1 < row->rlen) {
-                    row->hl[i + 1] = HL_STRING;
+                    hl[i + 1] = HL_STRING;
                     i += 2;
                     continue;
                 }
@@ -387,16 +1224,16 @@ void update_syntax(struct erow *row) {
 
             if (c == '"' || c == '\'') {
                 in_string = c;
-                row->hl[i] = HL_STRING;
+                hl[i] = HL_STRING;
                 i++;
                 continue;
             }
         }
 
         if (E.syntax->flags & HL_NUMBERS) {
-            if ((isdigit(c) && (after_sep || prev_hl == HL_NUMBER))
+            if ((isdigit((uint8_t) c) && (after_sep || prev_hl == HL_NUMBER))
                     || (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i++] = HL_NUMBER;
+                hl[i++] = HL_NUMBER;
                 after_sep = false;
                 continue;
             }
@@ -420,8 +1257,8 @@ void update_syntax(struct erow *row) {
                 }
 
                 if (!strncmp(&row->render[i], &keywords[j][1], len)
-                        && is_separator(row->render[i + len])) {
-                    memset(&row->hl[i], color, len);
+                        && is_separator((uint8_t) row->render[i + len])) {
+                    memset(&hl[i], color, len);
                     i += len;
                     break;
                 }
@@ -433,16 +1270,47 @@ void update_syntax(struct erow *row) {
             }
         }
 
-        after_sep = is_separator(c);
+        after_sep = is_separator((uint8_t) c);
         i++;
     }
 
-    bool changed = (row->comment != in_comment);
-    row->comment = in_comment;
+    set_spans(row, hl);
+
+    bool changed = (E.comments[y] != in_comment);
+    E.comments[y] = in_comment;
+
+    return changed;
+}
+
+void render_row(size_t y);
+void update_row(size_t y);
+
+void update_syntax(size_t y) {
+    PROFILE(P_UPDATE_SYNTAX, 'B');
+    uint64_t start = S.hud.active ? now_us() : 0;
+    size_t rows = 1;
+
+    // Rows below inherit the comment state; follow it until it settles.
+    while (highlight_row(y) && y + 1 < E.lines) {
+        y++;
+        rows++;
+
+        if (E.rows[y].render == NULL) {
+            render_row(y);
+        }
+    }
 
-    if (changed && row->idx + 1 < E.lines) {
-        update_syntax(&E.rows[row->idx + 1]);
+    if (S.hud.active) {
+        S.hud.syntax_us += now_us() - start;
+        S.hud.syntax_rows += rows;
     }
+
+    PROFILE(P_UPDATE_SYNTAX, 'E');
+}
+
+// With multi-line comments, a row's highlighting depends on the rows above.
+bool syntax_chains() {
+    return E.syntax && E.syntax->mlcomment_start && E.syntax->mlcomment_end;
 }
 
 uint8_t syntax_to_color(uint8_t hl) {
@@ -463,7 +1331,7 @@ uint8_t syntax_to_color(uint8_t hl) {
 void select_syntax() {
     E.syntax = NULL;
 
-    if (E.filename == NULL) {
+    if (E.filename == NULL || S.headless) {
         return;
     }
 
@@ -482,7 +1350,11 @@ void select_syntax() {
                 E.syntax = syntax;
 
                 for (size_t row = 0; row < E.lines; row++) {
-                    update_syntax(&E.rows[row]);
+                    if (E.rows[row].render != NULL) {
+                        update_syntax(row);
+                    } else if (syntax_chains()) {
+                        update_row(row);
+                    }
                 }
 
                 return;
@@ -493,445 +1365,5574 @@ void select_syntax() {
     }
 }
 
-size_t x_to_rx(struct erow *row, size_t x) {
-    size_t rx = 0;
+// Combining marks, joiners and other code points that attach to the one
+// before them.
+const struct erange zero_width[] = {
+    { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x0610, 0x061A },
+    { 0x064B, 0x065F }, { 0x0900, 0x0903 }, { 0x093A, 0x094F }, { 0x0E31, 0x0E31 },
+    { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E }, { 0x1AB0, 0x1AFF }, { 0x1DC0, 0x1DFF },
+    { 0x200B, 0x200F }, { 0x20D0, 0x20FF }, { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F },
+    { 0x1F3FB, 0x1F3FF }, { 0xE0020, 0xE007F }, { 0xE0100, 0xE01EF },
+};
 
-    for (size_t i = 0; i < x; i++) {
-        if (row->chars[i] == '\t') {
-            // A tab is every NIM_TAB_STOP columns.
-            rx += (NIM_TAB_STOP - 1) - (rx % NIM_TAB_STOP);
+// East Asian wide characters and emoji, which take two columns.
+const struct erange double_width[] = {
+    { 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC },
+    { 0x25FD, 0x25FE }, { 0x2614, 0x2615 }, { 0x2E80, 0x303E }, { 0x3041, 0x4DBF },
+    { 0x4E00, 0xA4CF }, { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE30, 0xFE4F },
+    { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x1F300, 0x1F64F }, { 0x1F680, 0x1F6FF },
+    { 0x1F900, 0x1F9FF }, { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD },
+};
+
+bool in_ranges(const struct erange *ranges, size_t count, uint32_t cp) {
+    size_t lo = 0;
+    size_t hi = count;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (cp < ranges[mid].first) {
+            hi = mid;
+        } else if (cp > ranges[mid].last) {
+            lo = mid + 1;
+        } else {
+            return true;
         }
+    }
 
-        rx++;
+    return false;
+}
+
+uint8_t char_width(uint32_t cp) {
+    if (cp < 0x300) {
+        return 1;
     }
 
-    return rx;
+    if (in_ranges(zero_width, sizeof(zero_width) / sizeof(zero_width[0]), cp)) {
+        return 0;
+    }
+
+    return in_ranges(double_width, sizeof(double_width) / sizeof(double_width[0]), cp) ? 2 : 1;
 }
 
-size_t rx_to_x(struct erow *row, size_t rx) {
-    size_t curr_rx = 0;
-    size_t x;
+// Checks eight bytes at a time, so plain ASCII rows skip the UTF-8 work.
+bool is_ascii(const char *s, size_t len) {
+    size_t i = 0;
 
-    for (x = 0; x < row->len; x++) {
-        if (row->chars[x] == '\t') {
-            curr_rx += (NIM_TAB_STOP - 1) - (curr_rx % NIM_TAB_STOP);
-        }
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, &s[i], 8);
 
-        curr_rx++;
+        if (word & 0x8080808080808080ULL) {
+            return false;
+        }
+    }
 
-        if (curr_rx > rx) {
-            return x;
+    for (; i < len; i++) {
+        if (s[i] & 0x80) {
+            return false;
         }
     }
 
-    return x;
+    return true;
 }
 
-void update_row(struct erow *row) {
-    size_t idx = 0;
-    size_t tabs = 0;
-
-    for (size_t i = 0; i < row->len; i++) {
-        if (row->chars[i] == '\t') {
-            tabs++;
-        }
+// Returns the length of the UTF-8 sequence at s[i], or 0 if it is invalid,
+// overlong, a surrogate or cut short.
+uint8_t decode_utf8(const char *s, size_t len, size_t i, uint32_t *cp) {
+    const uint8_t *u = (const uint8_t *) &s[i];
+    uint32_t min;
+    uint8_t n;
+
+    if (u[0] < 0x80) {
+        *cp = u[0];
+        return 1;
+    } else if ((u[0] & 0xE0) == 0xC0) {
+        *cp = u[0] & 0x1F;
+        min = 0x80;
+        n = 2;
+    } else if ((u[0] & 0xF0) == 0xE0) {
+        *cp = u[0] & 0x0F;
+        min = 0x800;
+        n = 3;
+    } else if ((u[0] & 0xF8) == 0xF0) {
+        *cp = u[0] & 0x07;
+        min = 0x10000;
+        n = 4;
+    } else {
+        return 0;
     }
 
-    free(row->render);
-    row->render = malloc(row->len + (tabs * (NIM_TAB_STOP - 1)) + 1);
-
-    for (size_t i = 0; i < row->len; i++) {
-        if (row->chars[i] == '\t') {
-            row->render[idx++] = ' ';
+    if (n > len - i) {
+        return 0;
+    }
 
-            while (idx % NIM_TAB_STOP != 0) {
-                row->render[idx++] = ' ';
-            }
-        } else {
-            row->render[idx++] = row->chars[i];
+    for (uint8_t k = 1; k < n; k++) {
+        if ((u[k] & 0xC0) != 0x80) {
+            return 0;
         }
+
+        *cp = (*cp << 6) | (u[k] & 0x3F);
     }
 
-    row->render[idx] = '\0';
-    row->rlen = idx;
+    if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF)) {
+        return 0;
+    }
 
-    update_syntax(row);
+    return n;
 }
 
-void insert_row(size_t at, char *s, size_t len) {
-    if (at > E.lines) {
-        return;
+// Returns the end of the grapheme cluster at s[i]: a character and the
+// ones attached to it, or a single invalid byte. Clusters are at least one
+// column wide so that the cursor can stop on each of them.
+size_t next_cluster(const char *s, size_t len, size_t i, uint8_t *width) {
+    uint32_t cp;
+    uint8_t n = decode_utf8(s, len, i, &cp);
+
+    if (n == 0) {
+        *width = 1;
+        return i + 1;
     }
 
-    E.rows = realloc(E.rows, (E.lines + 1) * sizeof(struct erow));
-    memmove(&E.rows[at + 1], &E.rows[at], (E.lines - at) * sizeof(struct erow));
+    *width = char_width(cp) ? char_width(cp) : 1;
+    bool join = (cp == 0x200D);
+    i += n;
+
+    while (i < len && (n = decode_utf8(s, len, i, &cp)) > 0) {
+        if (!join && char_width(cp) != 0) {
+            break;
+        }
 
-    for (size_t i = at + 1; i <= E.lines; i++) {
-        E.rows[i].idx++;
+        join = (cp == 0x200D);
+        i += n;
     }
 
-    struct erow *row = &E.rows[at];
-    row->idx = at;
-    row->comment = false;
-    row->len = len;
-    row->chars = malloc(len + 1);
-    memcpy(row->chars, s, len);
-    row->chars[len] = '\0';
-    row->render = NULL;
-    row->rlen = 0;
-    row->hl = NULL;
-    update_row(row);
+    return i;
+}
 
-    E.lines++;
-    E.dirty = true;
+// Returns the last cell whose field is at most value. Cells grow in every
+// field, so any of them can be searched.
+size_t find_cell(struct erow *row, size_t field, size_t value) {
+    size_t lo = 0;
+    size_t hi = row->ncells;
 
-    update_gutter();
-}
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        uint32_t key = *(uint32_t *) ((char *) &row->cells[mid] + field);
 
-void free_row(struct erow *row) {
-    free(row->hl);
-    free(row->render);
-    free(row->chars);
+        if (key <= value) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
 }
 
-void delete_row(size_t at) {
-    if (at >= E.lines) {
-        return;
+void unpack_row(size_t y);
+void ensure_row(size_t y);
+
+// Rows with multibyte text are rendered to get their cells.
+void ensure_cells(size_t y) {
+    struct erow *row = &E.rows[y];
+
+    if (row->render == NULL && !is_ascii(row->chars, E.lens[y])) {
+        ensure_row(y);
     }
+}
 
-    free_row(&E.rows[at]);
-    memmove(&E.rows[at], &E.rows[at + 1], (E.lines - at - 1) * sizeof(struct erow));
+size_t x_to_rx(size_t y, size_t x) {
+    unpack_row(y);
+    ensure_cells(y);
+    struct erow *row = &E.rows[y];
+    size_t rx = 0;
 
-    for (size_t i = at; i < E.lines - 1; i++) {
-        E.rows[i].idx--;
+    if (row->cells) {
+        return row->cells[find_cell(row, offsetof(struct ecell, x), x)].rx;
     }
 
-    E.lines--;
-    E.dirty = true;
+    for (size_t i = 0; i < x; i++) {
+        if (row->chars[i] == '\t') {
+            // A tab is every NIM_TAB_STOP columns.
+            rx += (NIM_TAB_STOP - 1) - (rx % NIM_TAB_STOP);
+        }
 
-    update_gutter();
+        rx++;
+    }
+
+    return rx;
 }
 
-void insert_char_at_row(struct erow *row, size_t at, uint16_t c) {
-    if (at > row->len) {
-        at = row->len;
+size_t rx_to_x(size_t y, size_t rx) {
+    unpack_row(y);
+    ensure_cells(y);
+    struct erow *row = &E.rows[y];
+    size_t curr_rx = 0;
+    size_t x;
+
+    if (row->cells) {
+        return row->cells[find_cell(row, offsetof(struct ecell, rx), rx)].x;
     }
 
-    row->chars = realloc(row->chars, row->len + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->len - at + 1);
-    row->chars[at] = c;
-    row->len++;
+    for (x = 0; x < E.lens[y]; x++) {
+        if (row->chars[x] == '\t') {
+            curr_rx += (NIM_TAB_STOP - 1) - (curr_rx % NIM_TAB_STOP);
+        }
 
-    update_row(row);
-    E.dirty = true;
-}
+        curr_rx++;
 
-void delete_char_at_row(struct erow *row, size_t at) {
-    if (at >= row->len) {
-        return;
+        if (curr_rx > rx) {
+            return x;
+        }
     }
 
-    memmove(&row->chars[at], &row->chars[at + 1], row->len - at);
-    row->len--;
-
-    update_row(row);
-    E.dirty = true;
+    return x;
 }
 
-void append_string_at_row(struct erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->len + len + 1);
-    memcpy(&row->chars[row->len], s, len);
-    row->len += len;
-    row->chars[row->len] = '\0';
-    update_row(row);
-    E.dirty = true;
-}
+// Maps an offset in the rendered text, such as a find match, to chars.
+size_t render_to_x(size_t y, size_t r) {
+    struct erow *row = &E.rows[y];
 
-void insert_char(uint16_t c) {
-    if (E.y == E.lines) {
-        insert_row(E.lines, "", 0);
+    if (row->cells) {
+        return row->cells[find_cell(row, offsetof(struct ecell, r), r)].x;
     }
 
-    insert_char_at_row(&E.rows[E.y], E.x, c);
-    E.x++;
+    return rx_to_x(y, r);
 }
 
-void insert_newline() {
-    if (E.x == 0) {
-        insert_row(E.y, "", 0);
-    } else {
-        struct erow *row = &E.rows[E.y];
-        insert_row(E.y + 1, &row->chars[E.x], row->len - E.x);
+// Returns the start of the grapheme cluster that x is in.
+size_t cell_x(size_t y, size_t x) {
+    ensure_row(y);
+    struct erow *row = &E.rows[y];
 
-        row = &E.rows[E.y];
-        row->len = E.x;
-        row->chars[row->len] = '\0';
-        update_row(row);
+    if (row->cells == NULL) {
+        return x;
     }
 
-    E.y++;
-    E.x = 0;
+    return row->cells[find_cell(row, offsetof(struct ecell, x), x)].x;
 }
 
-void delete_char() {
-    if ((E.x == 0 && E.y == 0) || E.y == E.lines) {
-        return;
-    }
-
-    struct erow *row = &E.rows[E.y];
+size_t next_x(size_t y, size_t x) {
+    ensure_row(y);
+    struct erow *row = &E.rows[y];
 
-    if (E.x > 0) {
-        delete_char_at_row(row, E.x - 1);
-        E.x--;
-    } else {
-        E.x = E.rows[E.y - 1].len;
-        append_string_at_row(&E.rows[E.y - 1], row->chars, row->len);
-        delete_row(E.y);
-        E.y--;
+    if (row->cells == NULL) {
+        return x + 1;
     }
+
+    return row->cells[find_cell(row, offsetof(struct ecell, x), x) + 1].x;
 }
 
-void open_file(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
+void lru_push(size_t idx, uint64_t stamp) {
+    struct elru *l = &E.lru;
 
-    FILE *fp = fopen(filename, "r");
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 1024;
+        struct elru_entry *entries = malloc(cap * sizeof(struct elru_entry));
 
-    if (!fp) {
-        die("fopen");
+        for (size_t i = 0; i < l->count; i++) {
+            entries[i] = l->entries[(l->head + i) % l->cap];
+        }
+
+        free(l->entries);
+        l->entries = entries;
+        l->head = 0;
+        l->cap = cap;
     }
 
-    select_syntax();
+    l->entries[(l->head + l->count) % l->cap] = (struct elru_entry) { idx, stamp, l->base + l->nshifts };
+    l->count++;
+}
 
-    char *line = NULL;
-    size_t size = 0;
+// Applies the shifts logged since the entry was queued or last resolved.
+void lru_resolve(struct elru_entry *entry) {
+    struct elru *l = &E.lru;
 
-    while (true) {
-        ssize_t len = getline(&line, &size, fp);
+    for (size_t k = entry->seen - l->base; k < l->nshifts && entry->idx != SIZE_MAX; k++) {
+        struct elru_shift *shift = &l->shifts[k];
 
-        if (len == -1) {
-            break;
+        if (entry->idx < shift->at) {
+            continue;
         }
 
-        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
-            len--;
+        if (shift->delta < 0 && entry->idx < shift->at - shift->delta) {
+            entry->idx = SIZE_MAX;
+        } else {
+            entry->idx += shift->delta;
         }
-
-        insert_row(E.lines, line, len);
     }
 
-    free(line);
-    fclose(fp);
-    E.dirty = false;
+    entry->seen = l->base + l->nshifts;
 }
 
-char *to_string(size_t *len) {
-    *len = 0;
+// Keeps the queue pointing at the same rows after rows were inserted
+// (delta > 0) or deleted (delta < 0) at the given index.
+void lru_shift(size_t at, ssize_t delta) {
+    struct elru *l = &E.lru;
 
-    for (size_t i = 0; i < E.lines; i++) {
-        *len += E.rows[i].len + 1;
+    if (l->count == 0) {
+        l->base += l->nshifts;
+        l->nshifts = 0;
+        return;
     }
 
-    char *buf = malloc(*len);
-    char *ptr = buf;
+    if (l->nshifts == NIM_LRU_SHIFTS) {
+        for (size_t i = 0; i < l->count; i++) {
+            lru_resolve(&l->entries[(l->head + i) % l->cap]);
+        }
 
-    for (size_t i = 0; i < E.lines; i++) {
-        memcpy(ptr, E.rows[i].chars, E.rows[i].len);
-        ptr += E.rows[i].len;
-        *ptr = '\n';
-        ptr++;
+        l->base += l->nshifts;
+        l->nshifts = 0;
     }
 
-    return buf;
+    l->shifts[l->nshifts++] = (struct elru_shift) { at, delta };
 }
 
-void save_file() {
-    if (E.filename == NULL) {
-        E.filename = prompt("Save as: %s (ESC to cancel)", NULL);
+void drop_render(struct erow *row) {
+    E.lru.resident -= derived_size(row);
 
-        if (E.filename == NULL) {
-            set_message("");
-            return;
+    free(row->render);
+    free(row->spans);
+    free(row->cells);
+    row->render = NULL;
+    row->rlen = 0;
+    row->spans = NULL;
+    row->nspans = 0;
+    row->cells = NULL;
+    row->ncells = 0;
+}
+
+// Drops the rendered text and highlighting of the least recently used
+// off-screen rows until they fit in the budget again. A row that was used
+// after it was queued is moved to the back instead, and so is the row
+// that is being rendered, since the caller is about to use it. Rows used
+// while the last frame was drawn are on screen, however the view maps them.
+void lru_evict(size_t keep) {
+    struct elru *l = &E.lru;
+    size_t tries = l->count;
+
+    while (l->resident > l->budget && l->count > 0 && tries-- > 0) {
+        struct elru_entry entry = l->entries[l->head];
+        l->head = (l->head + 1) % l->cap;
+        l->count--;
+        lru_resolve(&entry);
+
+        if (entry.idx >= E.lines || E.rows[entry.idx].render == NULL) {
+            continue;
         }
 
-        select_syntax();
+        struct erow *row = &E.rows[entry.idx];
+        bool visible = (row->used > l->frame && row->used <= l->drawn);
+
+        if (row->used != entry.stamp || visible || entry.idx == keep) {
+            lru_push(entry.idx, row->used);
+            continue;
+        }
+
+        drop_render(row);
     }
+}
 
-    size_t len;
-    char *buf = to_string(&len);
+// Rows with multibyte text keep a cell for every grapheme cluster, so
+// column math on them is a binary search. Invalid bytes are rendered as
+// DEL, which is drawn as a '?'.
+size_t render_cells(struct erow *row, size_t len) {
+    struct ecell *cells = malloc((len + 1) * sizeof(struct ecell));
+    size_t n = 0;
+    size_t idx = 0;
+    size_t rx = 0;
+    size_t i = 0;
 
-    int32_t fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+    while (i < len) {
+        cells[n++] = (struct ecell) { i, idx, rx };
 
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == (ssize_t) len) {
-                close(fd);
-                free(buf);
-                E.dirty = false;
-                set_message("%d bytes written to disk.", len);
-                return;
-            }
+        if (row->chars[i] == '\t') {
+            do {
+                row->render[idx++] = ' ';
+                rx++;
+            } while (rx % NIM_TAB_STOP != 0);
+
+            i++;
+            continue;
         }
 
-        close(fd);
+        uint8_t width;
+        size_t end = next_cluster(row->chars, len, i, &width);
+
+        if (end == i + 1 && (row->chars[i] & 0x80)) {
+            row->render[idx++] = 0x7f;
+        } else {
+            memcpy(&row->render[idx], &row->chars[i], end - i);
+            idx += end - i;
+        }
+
+        rx += width;
+        i = end;
     }
 
-    free(buf);
-    set_message("Save failed: %s", strerror(errno));
-}
+    cells[n++] = (struct ecell) { len, idx, rx };
+    row->cells = realloc(cells, n * sizeof(struct ecell));
+    row->ncells = n;
 
-void find(char *query, uint16_t key) {
-    static ssize_t last_match = -1;
-    static int8_t direction = 1;
+    return idx;
+}
 
-    static size_t line;
-    static char *hl = NULL;
+void render_row(size_t y) {
+    unpack_row(y);
+    struct erow *row = &E.rows[y];
+    size_t len = E.lens[y];
+    size_t idx = 0;
+    size_t tabs = 0;
 
-    if (hl) {
-        memcpy(E.rows[line].hl, hl, E.rows[line].rlen);
-        free(hl);
-        hl = NULL;
+    for (size_t i = 0; i < len; i++) {
+        if (row->chars[i] == '\t') {
+            tabs++;
+        }
     }
 
-    if (key == ENTER || key == ESCAPE) {
-        last_match = -1;
-        direction = 1;
-        return;
-    }
+    bool fresh = (row->render == NULL);
+    E.lru.resident -= fresh ? 0 : row->rlen + 1;
+    E.lru.resident -= row->ncells * sizeof(struct ecell);
 
-    if (key == ARROW_DOWN || key == ARROW_RIGHT) {
-        direction = 1;
-    } else if (key == ARROW_UP || key == ARROW_LEFT) {
-        direction = -1;
+    free(row->render);
+    free(row->cells);
+    row->render = malloc(len + (tabs * (NIM_TAB_STOP - 1)) + 1);
+    row->cells = NULL;
+    row->ncells = 0;
+
+    if (!is_ascii(row->chars, len)) {
+        idx = render_cells(row, len);
     } else {
-        last_match = -1;
-        direction = 1;
-    }
+        for (size_t i = 0; i < len; i++) {
+            if (row->chars[i] == '\t') {
+                row->render[idx++] = ' ';
 
-    if (last_match == -1) {
-        direction = 1;
+                while (idx % NIM_TAB_STOP != 0) {
+                    row->render[idx++] = ' ';
+                }
+            } else {
+                row->render[idx++] = row->chars[i];
+            }
+        }
     }
 
-    ssize_t y = last_match;
+    row->render[idx] = '\0';
+    row->rlen = idx;
 
-    for (size_t i = 0; i < E.lines; i++) {
-        y += direction;
+    E.lru.resident += row->rlen + 1 + row->ncells * sizeof(struct ecell);
+    row->used = ++E.lru.tick;
 
-        if (y == -1) {
-            y = E.lines - 1;
-        } else if (y == (ssize_t) E.lines) {
-            y = 0;
+    if (E.lru.budget > 0) {
+        if (fresh) {
+            lru_push(y, row->used);
         }
 
-        struct erow *row = &E.rows[y];
+        lru_evict(y);
+    }
+}
+
+void update_row(size_t y) {
+    PROFILE(P_UPDATE_ROW, 'B');
+
+    if (E.wrap.enabled) {
+        E.wrap.stamps[y] = 0;
+    }
+
+    filter_update(y);
+
+    // Without a screen, rows are rendered only when find needs them.
+    if (S.headless) {
+        drop_render(&E.rows[y]);
+    } else {
+        render_row(y);
+        update_syntax(y);
+    }
+
+    PROFILE(P_UPDATE_ROW, 'E');
+}
+
+// Rows are rendered when they are first needed; the comment state that
+// the highlighting of the next row depends on is always kept valid.
+void ensure_row(size_t y) {
+    if (E.rows[y].render == NULL) {
+        render_row(y);
+        update_syntax(y);
+    } else {
+        E.rows[y].used = ++E.lru.tick;
+    }
+}
+
+size_t encode_number(char *out, uint64_t n) {
+    size_t len = 0;
+
+    do {
+        out[len] = n & 0x7f;
+        n >>= 7;
+
+        if (n) {
+            out[len] |= 0x80;
+        }
+
+        len++;
+    } while (n);
+
+    return len;
+}
+
+uint64_t decode_number(char *buf, size_t size, size_t *pos, bool *ok) {
+    uint64_t n = 0;
+
+    for (uint8_t shift = 0; shift < 64; shift += 7) {
+        if (*pos >= size) {
+            break;
+        }
+
+        uint8_t byte = buf[(*pos)++];
+        n |= (uint64_t) (byte & 0x7f) << shift;
+
+        if (!(byte & 0x80)) {
+            return n;
+        }
+    }
+
+    *ok = false;
+    return 0;
+}
+
+char *sidecar_path(char *filename, char *ext) {
+    char *slash = strrchr(filename, '/');
+    char *name = slash ? slash + 1 : filename;
+    int dirlen = slash ? (int) (slash - filename + 1) : 0;
+
+    size_t size = strlen(filename) + strlen(ext) + 3;
+    char *path = malloc(size);
+    snprintf(path, size, "%.*s.%s.%s", dirlen, filename, name, ext);
+
+    return path;
+}
+
+int8_t journal_header(struct ejheader *header, char *filename) {
+    struct stat st;
+
+    if (stat(filename, &st) == -1) {
+        return -1;
+    }
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, NIM_JOURNAL_MAGIC, sizeof(header->magic));
+    header->version = NIM_JOURNAL_VERSION;
+    header->size = st.st_size;
+    header->mtime = st.st_mtim.tv_sec;
+    header->mtime_nsec = st.st_mtim.tv_nsec;
+
+    return 0;
+}
+
+int8_t journal_open() {
+    if (E.journal.fd != -1) {
+        return 0;
+    }
+
+    struct ejheader header;
+
+    if (E.journal.stale || journal_header(&header, E.filename) == -1) {
+        return -1;
+    }
+
+    char *path = sidecar_path(E.filename, "nimj");
+    int32_t fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+    if (fd == -1) {
+        free(path);
+        return -1;
+    }
+
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        close(fd);
+        unlink(path);
+        free(path);
+        return -1;
+    }
+
+    E.journal.fd = fd;
+    E.journal.path = path;
+    E.journal.size = sizeof(header);
+    E.journal.flushed = time(NULL);
+
+    return 0;
+}
+
+void journal_flush() {
+    struct ejournal *j = &E.journal;
+
+    if (j->fd == -1 || j->len == 0) {
+        return;
+    }
+
+    size_t done = 0;
+
+    while (done < j->len) {
+        ssize_t num = pwrite(j->fd, &j->buf[done], j->len - done, j->size + done);
+
+        if (num == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        done += num;
+    }
+
+    j->size += done;
+    j->len = 0;
+    j->flushed = time(NULL);
+}
+
+void journal_put(const void *s, size_t len) {
+    struct ejournal *j = &E.journal;
+
+    if (j->len + len > j->cap) {
+        j->cap = (j->len + len) * 2;
+        j->buf = realloc(j->buf, j->cap);
+    }
+
+    memcpy(&j->buf[j->len], s, len);
+    j->len += len;
+}
+
+void journal_put_number(uint64_t n) {
+    char bytes[10];
+    journal_put(bytes, encode_number(bytes, n));
+}
+
+// Records one row operation; the journal only ever grows with the edits.
+void journal_record(uint8_t op, size_t a, size_t b, const char *s, size_t len) {
+    if (!E.journal.enabled) {
+        return;
+    }
+
+    if (E.filename == NULL || journal_open() == -1) {
+        E.journal.stale = true;
+        return;
+    }
+
+    journal_put(&op, 1);
+    journal_put_number(a);
+    journal_put_number(b);
+    journal_put_number(len);
+    journal_put(s, len);
+
+    if (E.journal.len >= NIM_JOURNAL_BATCH || time(NULL) - E.journal.flushed >= NIM_JOURNAL_DELAY) {
+        journal_flush();
+    }
+}
+
+// Called when a save has written the snapshot taken at the journal mark.
+// The rebased journal is written beside the old one and renamed over it,
+// so a crash leaves one or the other, never a new header on old records.
+void journal_rebase(bool clean) {
+    struct ejournal *j = &E.journal;
+
+    if (clean) {
+        j->stale = false;
+    }
+
+    if (j->fd == -1) {
+        return;
+    }
+
+    journal_flush();
+
+    struct ejheader header;
+
+    if (journal_header(&header, E.filename) == -1) {
+        return;
+    }
+
+    char *tmp;
+    int32_t fd = open_temp_file(j->path, &tmp);
+
+    if (fd == -1) {
+        return;
+    }
+
+    size_t tail = j->size - j->mark;
+    char *buf = malloc(tail + 1);
+
+    if (pread(j->fd, buf, tail, j->mark) == (ssize_t) tail
+            && pwrite(fd, &header, sizeof(header), 0) == sizeof(header)
+            && pwrite(fd, buf, tail, sizeof(header)) == (ssize_t) tail
+            && (!NIM_FSYNC || fsync(fd) == 0)
+            && rename(tmp, j->path) == 0) {
+        close(j->fd);
+        j->fd = fd;
+        j->size = sizeof(header) + tail;
+    } else {
+        close(fd);
+        unlink(tmp);
+    }
+
+    free(buf);
+    free(tmp);
+}
+
+// The file grew on disk; the journal still applies to the new contents.
+void journal_touch() {
+    struct ejheader header;
+
+    if (E.journal.fd != -1 && journal_header(&header, E.filename) != -1) {
+        pwrite(E.journal.fd, &header, sizeof(header), 0);
+    }
+}
+
+void journal_close(bool discard) {
+    struct ejournal *j = &E.journal;
+
+    if (j->fd == -1) {
+        return;
+    }
+
+    journal_flush();
+    close(j->fd);
+
+    if (discard) {
+        unlink(j->path);
+    }
+
+    free(j->path);
+    j->fd = -1;
+    j->path = NULL;
+    j->size = 0;
+    j->mark = 0;
+}
+
+void undo_reserve(size_t size) {
+    struct eundo *u = &E.undo;
+
+    if (size > u->cap) {
+        u->cap = size * 2;
+        u->buf = realloc(u->buf, u->cap);
+    }
+}
+
+bool undo_decode(size_t start, struct eundo_rec *rec) {
+    struct eundo *u = &E.undo;
+    size_t pos = start + 1;
+    bool ok = (start < u->size);
+
+    if (!ok) {
+        return false;
+    }
+
+    rec->op = u->buf[start];
+    rec->group = decode_number(u->buf, u->size, &pos, &ok);
+    rec->row = decode_number(u->buf, u->size, &pos, &ok);
+    rec->at = decode_number(u->buf, u->size, &pos, &ok);
+    rec->len = decode_number(u->buf, u->size, &pos, &ok);
+    rec->cx = decode_number(u->buf, u->size, &pos, &ok);
+    rec->cy = decode_number(u->buf, u->size, &pos, &ok);
+    rec->ax = decode_number(u->buf, u->size, &pos, &ok);
+    rec->ay = decode_number(u->buf, u->size, &pos, &ok);
+    rec->start = start;
+    rec->data = &u->buf[pos];
+
+    return ok;
+}
+
+// Every record ends with its total size, so the log can be walked backwards.
+bool undo_before(size_t end, struct eundo_rec *rec) {
+    uint32_t size;
+
+    if (end < sizeof(size)) {
+        return false;
+    }
+
+    memcpy(&size, &E.undo.buf[end - sizeof(size)], sizeof(size));
+
+    return size <= end && undo_decode(end - size, rec);
+}
+
+size_t undo_end_of(struct eundo_rec *rec) {
+    return (rec->data - E.undo.buf) + rec->len + sizeof(uint32_t);
+}
+
+// Writes the header of rec at its start, moving keep bytes of data that
+// followed a header of old bytes so that gap bytes are free in front of
+// them. Returns the offset of the data.
+size_t undo_write(struct eundo_rec *rec, size_t old, size_t keep, size_t gap) {
+    struct eundo *u = &E.undo;
+    char header[1 + 8 * 10];
+    size_t len = 0;
+
+    header[len++] = rec->op;
+    len += encode_number(&header[len], rec->group);
+    len += encode_number(&header[len], rec->row);
+    len += encode_number(&header[len], rec->at);
+    len += encode_number(&header[len], rec->len);
+    len += encode_number(&header[len], rec->cx);
+    len += encode_number(&header[len], rec->cy);
+    len += encode_number(&header[len], rec->ax);
+    len += encode_number(&header[len], rec->ay);
+
+    size_t data = rec->start + len;
+    uint32_t size = len + rec->len + sizeof(size);
+
+    undo_reserve(data + rec->len + sizeof(size));
+    memmove(&u->buf[data + gap], &u->buf[rec->start + old], keep);
+    memcpy(&u->buf[rec->start], header, len);
+    memcpy(&u->buf[data + rec->len], &size, sizeof(size));
+
+    u->size = data + rec->len + sizeof(size);
+    u->pos = u->size;
+    rec->data = &u->buf[data];
+
+    return data;
+}
+
+// Drops the oldest groups until the log fits comfortably under its limit.
+void undo_trim() {
+    struct eundo *u = &E.undo;
+
+    if (u->size <= u->limit) {
+        return;
+    }
+
+    struct eundo_rec rec;
+    size_t cut = 0;
+
+    while (cut < u->size && u->size - cut > u->limit / 4 * 3 && undo_decode(cut, &rec)) {
+        uint64_t group = rec.group;
+
+        while (cut < u->size && undo_decode(cut, &rec) && rec.group == group) {
+            cut = undo_end_of(&rec);
+        }
+    }
+
+    memmove(u->buf, &u->buf[cut], u->size - cut);
+    u->size -= cut;
+    u->pos = (u->pos > cut) ? u->pos - cut : 0;
+}
+
+void undo_record(uint8_t op, size_t row, size_t at, const char *s, size_t len) {
+    struct eundo *u = &E.undo;
+
+    if (!u->enabled || u->applying) {
+        return;
+    }
+
+    // A new edit discards whatever could have been redone.
+    u->size = u->pos;
+
+    struct eundo_rec rec;
+
+    if (u->fresh && len == 1 && undo_before(u->pos, &rec) && rec.op == op && rec.row == row) {
+        bool append = (op == J_INSERT_CHAR && at == rec.at + rec.len)
+                || (op == J_DELETE_CHAR && at == rec.at);
+        bool prepend = (op == J_DELETE_CHAR && at + 1 == rec.at);
+
+        // Consecutive typing and deleting extend the previous record.
+        if (append || prepend) {
+            size_t old = rec.data - &u->buf[rec.start];
+            size_t keep = rec.len;
+
+            rec.len++;
+
+            if (prepend) {
+                rec.at = at;
+            }
+
+            size_t data = undo_write(&rec, old, keep, prepend ? 1 : 0);
+            u->buf[prepend ? data : data + keep] = s[0];
+
+            u->group = rec.group;
+            u->fresh = false;
+            return;
+        }
+    }
+
+    rec.op = op;
+    rec.group = u->group;
+    rec.row = row;
+    rec.at = at;
+    rec.len = len;
+    rec.cx = u->cx;
+    rec.cy = u->cy;
+    rec.ax = E.x;
+    rec.ay = E.y;
+    rec.start = u->pos;
+
+    size_t data = undo_write(&rec, 0, 0, 0);
+    memcpy(&u->buf[data], s, len);
+
+    u->fresh = false;
+    undo_trim();
+}
+
+void undo_begin() {
+    E.undo.group++;
+    E.undo.fresh = true;
+    E.undo.cx = E.x;
+    E.undo.cy = E.y;
+}
+
+// Remembers where the cursor ended up, for redo.
+void undo_end() {
+    struct eundo *u = &E.undo;
+    struct eundo_rec rec;
+
+    if (u->fresh || !undo_before(u->pos, &rec)) {
+        return;
+    }
+
+    rec.ax = E.x;
+    rec.ay = E.y;
+
+    undo_write(&rec, rec.data - &u->buf[rec.start], rec.len, 0);
+}
+
+// Recorded edits can no longer apply once rows moved underneath them.
+void undo_clear() {
+    E.undo.size = 0;
+    E.undo.pos = 0;
+}
+
+void mark_dirty() {
+    E.dirty = true;
+    E.changes++;
+}
+
+bool is_frozen(struct erow *row) {
+    return E.save.active && row->snap == E.save.id;
+}
+
+void keep_orphan(char *chars) {
+    E.save.orphans = realloc(E.save.orphans, (E.save.norphans + 1) * sizeof(char *));
+    E.save.orphans[E.save.norphans++] = chars;
+}
+
+// Rows captured by a background save or borrowed from a mapped file are
+// copied before they are modified.
+void thaw_row(size_t y) {
+    unpack_row(y);
+    struct erow *row = &E.rows[y];
+
+    if (!row->mapped && !is_frozen(row)) {
+        return;
+    }
+
+    char *chars = malloc(E.lens[y] + 1);
+    memcpy(chars, row->chars, E.lens[y]);
+    chars[E.lens[y]] = '\0';
+
+    if (!row->mapped) {
+        keep_orphan(row->chars);
+    }
+
+    row->chars = chars;
+    row->mapped = false;
+    row->snap = 0;
+}
+
+size_t lz_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+size_t lz_put_length(uint8_t *dst, size_t len) {
+    size_t n = 0;
+
+    while (len >= 255) {
+        dst[n++] = 255;
+        len -= 255;
+    }
+
+    dst[n++] = len;
+
+    return n;
+}
+
+// Writes one sequence: a token with both lengths, the literals, then the
+// offset of the match. The last sequence of a block has no match.
+size_t lz_put_sequence(uint8_t *dst, uint8_t *lit, size_t nlit, size_t offset, size_t mlen) {
+    size_t n = 1;
+    size_t mcode = mlen ? mlen - 4 : 0;
+
+    dst[0] = ((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15);
+
+    if (nlit >= 15) {
+        n += lz_put_length(&dst[n], nlit - 15);
+    }
+
+    memcpy(&dst[n], lit, nlit);
+    n += nlit;
+
+    if (mlen == 0) {
+        return n;
+    }
+
+    dst[n++] = offset & 0xff;
+    dst[n++] = offset >> 8;
+
+    if (mcode >= 15) {
+        n += lz_put_length(&dst[n], mcode - 15);
+    }
+
+    return n;
+}
+
+// A small LZ77 codec in the spirit of LZ4: greedy matches of at least four
+// bytes, found through a hash of the next four bytes, within 64KB.
+size_t lz_compress(uint8_t *src, size_t len, uint8_t *dst) {
+    static uint32_t table[1 << NIM_LZ_HASH];
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (ip + 4 <= len) {
+        uint32_t seq;
+        memcpy(&seq, &src[ip], 4);
+
+        uint32_t hash = (seq * 2654435761u) >> (32 - NIM_LZ_HASH);
+        size_t ref = table[hash];
+        table[hash] = ip;
+
+        if (ref >= ip || ip - ref > 65535 || memcmp(&src[ref], &src[ip], 4) != 0) {
+            ip++;
+            continue;
+        }
+
+        size_t mlen = 4;
+
+        while (ip + mlen < len && src[ref + mlen] == src[ip + mlen]) {
+            mlen++;
+        }
+
+        op += lz_put_sequence(&dst[op], &src[anchor], ip - anchor, ip - ref, mlen);
+        ip += mlen;
+        anchor = ip;
+    }
+
+    op += lz_put_sequence(&dst[op], &src[anchor], len - anchor, 0, 0);
+
+    return op;
+}
+
+size_t lz_get_length(uint8_t *src, size_t *ip) {
+    size_t len = 0;
+    uint8_t b;
+
+    do {
+        b = src[(*ip)++];
+        len += b;
+    } while (b == 255);
+
+    return len;
+}
+
+void lz_decompress(uint8_t *src, size_t size, uint8_t *dst) {
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < size) {
+        uint8_t token = src[ip++];
+        size_t nlit = token >> 4;
+
+        if (nlit == 15) {
+            nlit += lz_get_length(src, &ip);
+        }
+
+        memcpy(&dst[op], &src[ip], nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == size) {
+            break;
+        }
+
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        size_t mlen = (token & 15) + 4;
+        ip += 2;
+
+        if (mlen == 19) {
+            mlen += lz_get_length(src, &ip);
+        }
+
+        // Matches may overlap the bytes they produce.
+        for (size_t i = 0; i < mlen; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+}
+
+// Replaces the text of rows [at, at + count) with one compressed block.
+void pack_rows(size_t at, size_t count) {
+    size_t raw = 0;
+
+    for (size_t i = at; i < at + count; i++) {
+        raw += E.lens[i];
+    }
+
+    uint8_t *buf = malloc(raw + 1);
+    uint8_t *data = malloc(lz_bound(raw));
+    size_t offset = 0;
+
+    for (size_t i = at; i < at + count; i++) {
+        memcpy(&buf[offset], E.rows[i].chars, E.lens[i]);
+        offset += E.lens[i];
+    }
+
+    struct eblock *block = malloc(sizeof(struct eblock));
+    block->size = lz_compress(buf, raw, data);
+    block->data = realloc(data, block->size);
+    block->raw = raw;
+    block->lines = count;
+    free(buf);
+
+    for (size_t i = at; i < at + count; i++) {
+        struct erow *row = &E.rows[i];
+        drop_render(row);
+        free(row->chars);
+        row->chars = NULL;
+        row->block = block;
+    }
+
+    E.pack.size += block->size;
+    E.pack.raw += raw;
+}
+
+// Gives every row of the block that holds row y its text back. The rows of
+// a block are always adjacent.
+void unpack_row(size_t y) {
+    struct eblock *block = E.rows[y].block;
+
+    if (block == NULL) {
+        return;
+    }
+
+    size_t at = y;
+
+    while (at > 0 && E.rows[at - 1].block == block) {
+        at--;
+    }
+
+    char *buf = malloc(block->raw + 1);
+    lz_decompress((uint8_t *) block->data, block->size, (uint8_t *) buf);
+
+    size_t offset = 0;
+
+    for (size_t i = at; i < at + block->lines; i++) {
+        struct erow *row = &E.rows[i];
+        row->chars = malloc(E.lens[i] + 1);
+        memcpy(row->chars, &buf[offset], E.lens[i]);
+        row->chars[E.lens[i]] = '\0';
+        row->block = NULL;
+        offset += E.lens[i];
+    }
+
+    E.pack.size -= block->size;
+    E.pack.raw -= block->raw;
+    E.pack.idle = false;
+
+    free(buf);
+
+    // A background save may still be reading the block; its rows are not
+    // in the snapshot, so they need no copy on write.
+    if (E.save.active) {
+        for (size_t i = at; i < at + block->lines; i++) {
+            E.rows[i].snap = 0;
+        }
+
+        keep_orphan(block->data);
+        keep_orphan((char *) block);
+        return;
+    }
+
+    free(block->data);
+    free(block);
+}
+
+// Packs groups of rows that are far from the viewport, a few milliseconds
+// at a time. Rows borrowed from a mapped file are left alone.
+void pack_cold_rows() {
+    struct epack *p = &E.pack;
+
+    if (!p->enabled || E.save.active || E.lines == 0) {
+        return;
+    }
+
+    if (p->idle && p->rowoff == E.rowoff) {
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t deadline = ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + NIM_PACK_SLICE;
+
+    size_t low = (E.rowoff > NIM_PACK_MARGIN) ? E.rowoff - NIM_PACK_MARGIN : 0;
+    size_t high = E.rowoff + S.h + NIM_PACK_MARGIN;
+    size_t groups = (E.lines + NIM_PACK_ROWS - 1) / NIM_PACK_ROWS;
+
+    p->idle = false;
+    p->rowoff = E.rowoff;
+
+    for (size_t n = 0; n < groups; n++) {
+        if (p->next >= E.lines) {
+            p->next = 0;
+        }
+
+        size_t at = p->next;
+        size_t count = (E.lines - at < NIM_PACK_ROWS) ? E.lines - at : NIM_PACK_ROWS;
+        bool cold = (at + count <= low || at >= high) && (E.y < at || E.y >= at + count);
+
+        p->next += NIM_PACK_ROWS;
+
+        for (size_t i = at; cold && i < at + count; i++) {
+            cold = !E.rows[i].mapped && E.rows[i].block == NULL;
+        }
+
+        if (cold) {
+            pack_rows(at, count);
+            p->trim = true;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+
+            if ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000 >= deadline) {
+                return;
+            }
+        }
+    }
+
+    // The row text was freed in small pieces; hand the pages back.
+    if (p->trim) {
+        malloc_trim(0);
+        p->trim = false;
+    }
+
+    p->idle = true;
+}
+
+size_t worker_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1) {
+        return 1;
+    }
+
+    return (n > NIM_MAX_WORKERS) ? NIM_MAX_WORKERS : n;
+}
+
+bool filter_match(const char *text, size_t len) {
+    return E.filter.plen == 0 || memmem(text, len, E.filter.pattern, E.filter.plen) != NULL;
+}
+
+// Returns the position of the first row in the index at or after y.
+size_t filter_find(size_t y) {
+    struct efilter *f = &E.filter;
+    size_t lo = 0;
+    size_t hi = f->count;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (f->rows[mid] < y) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+size_t filter_row(size_t pos) {
+    return (pos < E.filter.count) ? E.filter.rows[pos] : E.lines;
+}
+
+void filter_add(size_t y) {
+    struct efilter *f = &E.filter;
+    size_t pos = filter_find(y);
+
+    if (pos < f->count && f->rows[pos] == y) {
+        return;
+    }
+
+    if (f->count == f->cap) {
+        f->cap = f->cap ? f->cap * 2 : 64;
+        f->rows = realloc(f->rows, f->cap * sizeof(size_t));
+    }
+
+    memmove(&f->rows[pos + 1], &f->rows[pos], (f->count - pos) * sizeof(size_t));
+    f->rows[pos] = y;
+    f->count++;
+}
+
+// Rows from at on move with inserted and deleted rows; deleted rows leave
+// the index.
+void filter_shift(size_t at, ssize_t delta) {
+    struct efilter *f = &E.filter;
+
+    if (!f->active) {
+        return;
+    }
+
+    size_t pos = filter_find(at);
+
+    if (delta < 0) {
+        size_t end = filter_find(at - delta);
+        memmove(&f->rows[pos], &f->rows[end], (f->count - end) * sizeof(size_t));
+        f->count -= end - pos;
+    }
+
+    for (size_t i = pos; i < f->count; i++) {
+        f->rows[i] += delta;
+    }
+}
+
+// Rows that come to match are shown; edited rows that stop matching stay
+// until the filter is run again, so that they do not vanish while typing.
+void filter_update(size_t y) {
+    if (!E.filter.active) {
+        return;
+    }
+
+    unpack_row(y);
+
+    if (filter_match(E.rows[y].chars, E.lens[y])) {
+        filter_add(y);
+    }
+}
+
+// Packed rows are decompressed into a private buffer, so workers never
+// change the rows they read.
+void *filter_worker(void *arg) {
+    struct efilter_job *job = arg;
+    struct eblock *block = NULL;
+    char *buf = NULL;
+    size_t offset = 0;
+
+    for (size_t y = job->lo; y < job->hi; y++) {
+        struct erow *row = &E.rows[y];
+        char *text = row->chars;
+
+        if (row->block && row->block != block) {
+            size_t at = y;
+            block = row->block;
+            buf = realloc(buf, block->raw + 1);
+            lz_decompress((uint8_t *) block->data, block->size, (uint8_t *) buf);
+
+            while (at > 0 && E.rows[at - 1].block == block) {
+                at--;
+            }
+
+            for (offset = 0; at < y; at++) {
+                offset += E.lens[at];
+            }
+        }
+
+        if (row->block) {
+            text = &buf[offset];
+            offset += E.lens[y];
+        }
+
+        if (!filter_match(text, E.lens[y])) {
+            continue;
+        }
+
+        if (job->count == job->cap) {
+            job->cap = job->cap ? job->cap * 2 : 64;
+            job->rows = realloc(job->rows, job->cap * sizeof(size_t));
+        }
+
+        job->rows[job->count++] = y;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// Large buffers are split into one range of rows per core.
+void build_filter() {
+    struct efilter *f = &E.filter;
+    size_t n = (E.lines >= NIM_FILTER_PARALLEL) ? worker_count() : 1;
+    struct efilter_job *jobs = calloc(n, sizeof(struct efilter_job));
+
+    for (size_t i = 0; i < n; i++) {
+        jobs[i].lo = E.lines * i / n;
+        jobs[i].hi = E.lines * (i + 1) / n;
+        jobs[i].started = (n > 1 && pthread_create(&jobs[i].thread, NULL, filter_worker, &jobs[i]) == 0);
+
+        if (!jobs[i].started) {
+            filter_worker(&jobs[i]);
+        }
+    }
+
+    f->count = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        if (jobs[i].started) {
+            pthread_join(jobs[i].thread, NULL);
+        }
+
+        f->count += jobs[i].count;
+    }
+
+    f->cap = f->count;
+    f->rows = realloc(f->rows, (f->cap ? f->cap : 1) * sizeof(size_t));
+
+    for (size_t i = 0, pos = 0; i < n; i++) {
+        memcpy(&f->rows[pos], jobs[i].rows, jobs[i].count * sizeof(size_t));
+        pos += jobs[i].count;
+        free(jobs[i].rows);
+    }
+
+    free(jobs);
+}
+
+void clear_filter() {
+    struct efilter *f = &E.filter;
+
+    f->active = false;
+    free(f->pattern);
+    free(f->rows);
+    f->pattern = NULL;
+    f->rows = NULL;
+    f->count = 0;
+    f->cap = 0;
+}
+
+// Rows above and below y, skipping those hidden by the filter.
+size_t row_above(size_t y) {
+    if (!E.filter.active) {
+        return y - 1;
+    }
+
+    size_t pos = filter_find(y);
+
+    return (pos > 0) ? E.filter.rows[pos - 1] : y;
+}
+
+size_t row_below(size_t y) {
+    if (!E.filter.active) {
+        return y + 1;
+    }
+
+    size_t pos = filter_find(y);
+
+    if (pos < E.filter.count && E.filter.rows[pos] == y) {
+        pos++;
+    }
+
+    return (pos < E.filter.count) ? E.filter.rows[pos] : y;
+}
+
+// Soft wrap keeps the number of screen lines of every row, stamped with
+// the width it was counted for, and a Fenwick tree over the counts so that
+// screen lines and rows map to each other in O(log n). A count is redone
+// only when its row is edited, or visited after the width changed.
+void wrap_reserve() {
+    struct ewrap *w = &E.wrap;
+
+    if (!w->enabled) {
+        return;
+    }
+
+    w->counts = realloc(w->counts, E.capacity * sizeof(uint32_t));
+    w->stamps = realloc(w->stamps, E.capacity * sizeof(uint8_t));
+    w->tree = realloc(w->tree, (E.capacity + 1) * sizeof(size_t));
+}
+
+// Moves the counts along with the rows; the tree is rebuilt from the first
+// moved row when it is next used.
+void wrap_shift(size_t at, ssize_t delta) {
+    struct ewrap *w = &E.wrap;
+
+    if (!w->enabled) {
+        return;
+    }
+
+    if (delta > 0) {
+        size_t tail = E.lines - at;
+        memmove(&w->counts[at + delta], &w->counts[at], tail * sizeof(uint32_t));
+        memmove(&w->stamps[at + delta], &w->stamps[at], tail * sizeof(uint8_t));
+
+        for (size_t i = at; i < at + delta; i++) {
+            w->counts[i] = 1;
+            w->stamps[i] = 0;
+        }
+    } else {
+        size_t tail = E.lines - at + delta;
+        memmove(&w->counts[at], &w->counts[at - delta], tail * sizeof(uint32_t));
+        memmove(&w->stamps[at], &w->stamps[at - delta], tail * sizeof(uint8_t));
+    }
+
+    w->dirty = (at < w->dirty) ? at : w->dirty;
+}
+
+// Nodes below the first changed row are still valid and are only added to
+// their parents again.
+void wrap_build() {
+    struct ewrap *w = &E.wrap;
+    size_t n = E.lines;
+
+    if (w->dirty >= n) {
+        w->dirty = SIZE_MAX;
+        return;
+    }
+
+    for (size_t i = w->dirty + 1; i <= n; i++) {
+        w->tree[i] = w->counts[i - 1];
+    }
+
+    for (size_t i = 1; i <= n; i++) {
+        size_t parent = i + (i & -i);
+
+        if (parent <= n && parent > w->dirty) {
+            w->tree[parent] += w->tree[i];
+        }
+    }
+
+    w->dirty = SIZE_MAX;
+}
+
+// Screen lines above row y.
+size_t wrap_prefix(size_t y) {
+    wrap_build();
+    size_t sum = 0;
+
+    for (size_t i = y; i > 0; i -= i & -i) {
+        sum += E.wrap.tree[i];
+    }
+
+    return sum;
+}
+
+// Returns where the next screen line of row y starts, given the column the
+// current one starts at. Wide characters are never split between lines.
+size_t wrap_next(size_t y, size_t start) {
+    struct erow *row = &E.rows[y];
+
+    if (row->cells == NULL) {
+        return start + S.w;
+    }
+
+    size_t i = find_cell(row, offsetof(struct ecell, rx), start + S.w);
+
+    if (row->cells[i].rx <= start && i + 1 < row->ncells) {
+        i++;
+    }
+
+    return row->cells[i].rx;
+}
+
+// A row has one more line than its text fills when it exactly fills the
+// last one, so that the cursor has somewhere to go after it.
+bool wrap_continues(size_t start, size_t next, size_t total) {
+    return next < total || next == start + S.w;
+}
+
+uint32_t wrap_lines(size_t y) {
+    size_t total = x_to_rx(y, E.lens[y]);
+    ensure_row(y);
+
+    if (E.rows[y].cells == NULL) {
+        return total / S.w + 1;
+    }
+
+    uint32_t count = 1;
+    size_t start = 0;
+    size_t next;
+
+    while (wrap_continues(start, next = wrap_next(y, start), total)) {
+        start = next;
+        count++;
+    }
+
+    return count;
+}
+
+uint32_t wrap_count(size_t y) {
+    struct ewrap *w = &E.wrap;
+
+    if (w->stamps[y] != w->stamp) {
+        uint32_t count = wrap_lines(y);
+
+        if (y < w->dirty) {
+            for (size_t i = y + 1; i <= E.lines; i += i & -i) {
+                w->tree[i] = w->tree[i] + count - w->counts[y];
+            }
+        }
+
+        w->counts[y] = count;
+        w->stamps[y] = w->stamp;
+    }
+
+    return w->counts[y];
+}
+
+// Returns the row at a screen line counted from the top of the buffer, and
+// the line within that row.
+size_t wrap_locate(size_t line, size_t *sub) {
+    struct ewrap *w = &E.wrap;
+    size_t step = 1;
+    size_t y = 0;
+
+    wrap_build();
+
+    while (step * 2 <= E.lines) {
+        step *= 2;
+    }
+
+    for (; step > 0; step /= 2) {
+        if (y + step <= E.lines && w->tree[y + step] <= line) {
+            y += step;
+            line -= w->tree[y];
+        }
+    }
+
+    *sub = 0;
+
+    if (y >= E.lines) {
+        return E.lines;
+    }
+
+    uint32_t count = wrap_count(y);
+    *sub = (line < count) ? line : count - 1;
+
+    return y;
+}
+
+// Column the given screen line of row y starts at.
+size_t wrap_start(size_t y, size_t sub) {
+    if (y >= E.lines) {
+        return 0;
+    }
+
+    ensure_row(y);
+
+    if (E.rows[y].cells == NULL) {
+        return sub * S.w;
+    }
+
+    size_t start = 0;
+
+    while (sub-- > 0) {
+        start = wrap_next(y, start);
+    }
+
+    return start;
+}
+
+// Returns the screen line of row y that column rx is on, and where it starts.
+size_t wrap_line_of(size_t y, size_t rx, size_t *start) {
+    *start = 0;
+
+    if (y >= E.lines) {
+        return 0;
+    }
+
+    ensure_row(y);
+    struct erow *row = &E.rows[y];
+
+    if (row->cells == NULL) {
+        *start = rx / S.w * S.w;
+        return rx / S.w;
+    }
+
+    size_t total = row->cells[row->ncells - 1].rx;
+    size_t line = 0;
+    size_t next;
+
+    while (rx >= (next = wrap_next(y, *start)) && wrap_continues(*start, next, total)) {
+        *start = next;
+        line++;
+    }
+
+    return line;
+}
+
+// Counts are redone lazily; a new width only gets a new stamp.
+void wrap_sync() {
+    struct ewrap *w = &E.wrap;
+
+    if (S.w == w->width) {
+        return;
+    }
+
+    w->width = S.w;
+
+    if (++w->stamp == 0) {
+        memset(w->stamps, 0, E.lines);
+        w->stamp = 1;
+    }
+}
+
+// Until rows are visited their counts are guessed from their length, which
+// is cheap with the lengths in one array.
+void toggle_wrap() {
+    struct ewrap *w = &E.wrap;
+
+    if (E.filter.active && !w->enabled) {
+        set_message("Soft wrap is off while filtering");
+        return;
+    }
+
+    w->enabled = !w->enabled;
+    w->lineoff = 0;
+
+    if (!w->enabled) {
+        free(w->counts);
+        free(w->stamps);
+        free(w->tree);
+        w->counts = NULL;
+        w->stamps = NULL;
+        w->tree = NULL;
+        set_message("Soft wrap off");
+        return;
+    }
+
+    wrap_reserve();
+    w->width = S.w;
+    w->stamp = 1;
+    w->dirty = 0;
+
+    for (size_t y = 0; y < E.lines; y++) {
+        w->counts[y] = E.lens[y] / S.w + 1;
+        w->stamps[y] = 0;
+    }
+
+    E.coloff = 0;
+    set_message("Soft wrap on");
+}
+
+// Moves the cursor one screen line, keeping its column on the screen.
+void wrap_move(bool down) {
+    size_t rx = (E.y < E.lines) ? x_to_rx(E.y, E.x) : 0;
+    size_t start;
+    size_t line = wrap_line_of(E.y, rx, &start);
+    size_t col = rx - start;
+    size_t y = E.y;
+
+    if (down && y >= E.lines) {
+        return;
+    } else if (down && line + 1 < wrap_count(y)) {
+        line++;
+    } else if (down) {
+        y++;
+        line = 0;
+    } else if (line > 0) {
+        line--;
+    } else if (y > 0) {
+        y--;
+        line = wrap_count(y) - 1;
+    } else {
+        return;
+    }
+
+    E.y = y;
+    E.x = 0;
+
+    if (y < E.lines) {
+        start = wrap_start(y, line);
+        size_t next = wrap_next(y, start);
+
+        if (start + col >= next && line + 1 < wrap_count(y)) {
+            col = next - start - 1;
+        }
+
+        E.x = rx_to_x(y, start + col);
+    }
+}
+
+// Pages by screen lines and puts the cursor on the first one.
+void wrap_page(bool down) {
+    size_t top = wrap_prefix(E.rowoff) + E.wrap.lineoff;
+    size_t total = wrap_prefix(E.lines);
+    size_t line = down ? top + S.h : ((top > S.h) ? top - S.h : 0);
+
+    if (total == 0) {
+        return;
+    }
+
+    if (line >= total) {
+        line = total - 1;
+    }
+
+    E.rowoff = wrap_locate(line, &E.wrap.lineoff);
+    E.y = E.rowoff;
+    E.x = rx_to_x(E.y, wrap_start(E.y, E.wrap.lineoff));
+}
+
+// Scrolls so the cursor is on screen, counting only the rows in between.
+void wrap_scroll() {
+    struct ewrap *w = &E.wrap;
+    wrap_sync();
+
+    size_t start;
+    size_t line = wrap_line_of(E.y, E.rx, &start);
+
+    E.coloff = 0;
+    w->cx = E.rx - start;
+
+    if (E.rowoff < E.lines && w->lineoff >= wrap_count(E.rowoff)) {
+        w->lineoff = wrap_count(E.rowoff) - 1;
+    }
+
+    if (E.y < E.rowoff || (E.y == E.rowoff && line < w->lineoff)) {
+        E.rowoff = E.y;
+        w->lineoff = line;
+        w->cy = 0;
+        return;
+    }
+
+    size_t dist = S.h;
+
+    if (E.y - E.rowoff < S.h) {
+        dist = line - w->lineoff;
+
+        for (size_t y = E.rowoff; y < E.y; y++) {
+            dist += wrap_count(y);
+        }
+    }
+
+    w->cy = dist;
+
+    if (dist < S.h) {
+        return;
+    }
+
+    size_t need = S.h - 1;
+    size_t y = E.y;
+
+    while (need > 0 && (line > 0 || y > 0)) {
+        if (line > 0) {
+            size_t step = (line < need) ? line : need;
+            line -= step;
+            need -= step;
+        } else {
+            line = wrap_count(--y) - 1;
+            need--;
+        }
+    }
+
+    E.rowoff = y;
+    w->lineoff = line;
+    w->cy = S.h - 1 - need;
+}
+
+void reserve_rows(size_t count) {
+    if (count <= E.capacity) {
+        return;
+    }
+
+    E.capacity = (count < 16) ? 16 : count + count / 2;
+    E.rows = realloc(E.rows, E.capacity * sizeof(struct erow));
+    E.lens = realloc(E.lens, E.capacity * sizeof(size_t));
+    E.comments = realloc(E.comments, E.capacity * sizeof(bool));
+    wrap_reserve();
+}
+
+// The last line of a file without a trailing newline is the partial row;
+// the next appended bytes continue it. Rows added below it end that.
+void partial_shift(size_t at, ssize_t delta) {
+    if (E.partial == SIZE_MAX) {
+        return;
+    }
+
+    if (at > E.partial) {
+        E.partial = (delta > 0) ? SIZE_MAX : E.partial;
+    } else if (delta < 0 && E.partial < at - delta) {
+        E.partial = SIZE_MAX;
+    } else {
+        E.partial += delta;
+    }
+}
+
+void splice_rows(size_t at, struct eslice *rows, size_t count) {
+    // Rows of a block stay adjacent, so a block is never split.
+    if (at < E.lines) {
+        unpack_row(at);
+    }
+
+    reserve_rows(E.lines + count);
+    memmove(&E.rows[at + count], &E.rows[at], (E.lines - at) * sizeof(struct erow));
+    memmove(&E.lens[at + count], &E.lens[at], (E.lines - at) * sizeof(size_t));
+    memmove(&E.comments[at + count], &E.comments[at], (E.lines - at) * sizeof(bool));
+    wrap_shift(at, count);
+    filter_shift(at, count);
+    partial_shift(at, count);
+
+    if (at < E.lines) {
+        lru_shift(at, count);
+    }
+
+    E.lines += count;
+
+    for (size_t i = 0; i < count; i++) {
+        struct erow *row = &E.rows[at + i];
+        E.lens[at + i] = rows[i].len;
+        E.comments[at + i] = false;
+        row->mapped = false;
+        row->snap = 0;
+        row->used = 0;
+        row->chars = malloc(rows[i].len + 1);
+        memcpy(row->chars, rows[i].chars, rows[i].len);
+        row->chars[rows[i].len] = '\0';
+        row->render = NULL;
+        row->rlen = 0;
+        row->spans = NULL;
+        row->nspans = 0;
+        row->cells = NULL;
+        row->ncells = 0;
+        row->block = NULL;
+    }
+
+    E.pack.idle = false;
+
+    for (size_t i = 0; i < count && syntax_chains(); i++) {
+        ensure_row(at + i);
+    }
+}
+
+void insert_rows(size_t at, struct eslice *rows, size_t count) {
+    if (at > E.lines || count == 0) {
+        return;
+    }
+
+    splice_rows(at, rows, count);
+
+    for (size_t i = 0; i < count; i++) {
+        undo_record(J_INSERT_ROW, at + i, 0, rows[i].chars, rows[i].len);
+        journal_record(J_INSERT_ROW, at + i, 0, rows[i].chars, rows[i].len);
+
+        if (E.filter.active) {
+            filter_add(at + i);
+        }
+    }
+
+    mark_dirty();
+    update_gutter();
+}
+
+void insert_row(size_t at, char *s, size_t len) {
+    struct eslice row = { s, len };
+    insert_rows(at, &row, 1);
+}
+
+void free_row(struct erow *row) {
+    drop_render(row);
+
+    if (row->mapped) {
+        return;
+    }
+
+    if (is_frozen(row)) {
+        keep_orphan(row->chars);
+    } else {
+        free(row->chars);
+    }
+}
+
+// Frees rows [at, at + count) and closes the gap, without recording it.
+void remove_rows(size_t at, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        unpack_row(at + i);
+        free_row(&E.rows[at + i]);
+    }
+
+    size_t tail = E.lines - at - count;
+    memmove(&E.rows[at], &E.rows[at + count], tail * sizeof(struct erow));
+    memmove(&E.lens[at], &E.lens[at + count], tail * sizeof(size_t));
+    memmove(&E.comments[at], &E.comments[at + count], tail * sizeof(bool));
+    wrap_shift(at, -(ssize_t) count);
+    filter_shift(at, -(ssize_t) count);
+    partial_shift(at, -(ssize_t) count);
+    E.lines -= count;
+    lru_shift(at, -(ssize_t) count);
+}
+
+void delete_rows(size_t at, size_t count) {
+    if (at >= E.lines || count == 0) {
+        return;
+    }
+
+    if (count > E.lines - at) {
+        count = E.lines - at;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        unpack_row(at + i);
+
+        struct erow *row = &E.rows[at + i];
+        undo_record(J_DELETE_ROW, at, 0, row->chars, E.lens[at + i]);
+        journal_record(J_DELETE_ROW, at, 0, NULL, 0);
+    }
+
+    remove_rows(at, count);
+
+    mark_dirty();
+    update_gutter();
+}
+
+void delete_row(size_t at) {
+    delete_rows(at, 1);
+}
+
+// Appends file contents to the end of the buffer. This is loading, not
+// editing, so nothing is journaled, recorded for undo or marked dirty.
+void append_bytes(char *buf, size_t len) {
+    size_t count = 0;
+    size_t cap = 64;
+    struct eslice *rows = malloc(cap * sizeof(struct eslice));
+    bool join = (E.partial != SIZE_MAX && E.partial + 1 == E.lines);
+    bool partial = false;
+
+    while (len > 0) {
+        char *nl = memchr(buf, '\n', len);
+        size_t end = nl ? (size_t) (nl - buf) : len;
+        size_t next = nl ? end + 1 : len;
+
+        if (join) {
+            size_t y = E.partial;
+            struct erow *row = &E.rows[y];
+
+            thaw_row(y);
+            row->chars = realloc(row->chars, E.lens[y] + end + 1);
+            memcpy(&row->chars[E.lens[y]], buf, end);
+            E.lens[y] += end;
+
+            while (nl && E.lens[y] > 0 && row->chars[E.lens[y] - 1] == '\r') {
+                E.lens[y]--;
+            }
+
+            row->chars[E.lens[y]] = '\0';
+            update_row(y);
+            join = false;
+        } else {
+            if (count == cap) {
+                cap *= 2;
+                rows = realloc(rows, cap * sizeof(struct eslice));
+            }
+
+            rows[count].chars = buf;
+            rows[count].len = end;
+
+            while (nl && rows[count].len > 0 && buf[rows[count].len - 1] == '\r') {
+                rows[count].len--;
+            }
+
+            count++;
+        }
+
+        // Only the last line of a chunk can still be waiting for its newline.
+        partial = (nl == NULL);
+
+        buf += next;
+        len -= next;
+    }
+
+    splice_rows(E.lines, rows, count);
+    free(rows);
+
+    if (count > 0 || !join) {
+        E.partial = partial ? E.lines - 1 : SIZE_MAX;
+    }
+
+    for (size_t y = E.lines - count; y < E.lines; y++) {
+        filter_update(y);
+    }
+
+    update_gutter();
+}
+
+void insert_char_at_row(size_t y, size_t at, uint16_t c) {
+    struct erow *row = &E.rows[y];
+
+    if (at > E.lens[y]) {
+        at = E.lens[y];
+    }
+
+    thaw_row(y);
+    row->chars = realloc(row->chars, E.lens[y] + 2);
+    memmove(&row->chars[at + 1], &row->chars[at], E.lens[y] - at + 1);
+    row->chars[at] = c;
+    E.lens[y]++;
+
+    update_row(y);
+    mark_dirty();
+    undo_record(J_INSERT_CHAR, y, at, &row->chars[at], 1);
+    journal_record(J_INSERT_CHAR, y, at, &row->chars[at], 1);
+}
+
+void delete_char_at_row(size_t y, size_t at) {
+    struct erow *row = &E.rows[y];
+
+    if (at >= E.lens[y]) {
+        return;
+    }
+
+    thaw_row(y);
+    undo_record(J_DELETE_CHAR, y, at, &row->chars[at], 1);
+    memmove(&row->chars[at], &row->chars[at + 1], E.lens[y] - at);
+    E.lens[y]--;
+
+    update_row(y);
+    mark_dirty();
+    journal_record(J_DELETE_CHAR, y, at, NULL, 0);
+}
+
+void append_string_at_row(size_t y, char *s, size_t len) {
+    struct erow *row = &E.rows[y];
+
+    thaw_row(y);
+    undo_record(J_APPEND, y, E.lens[y], s, len);
+    row->chars = realloc(row->chars, E.lens[y] + len + 1);
+    memcpy(&row->chars[E.lens[y]], s, len);
+    E.lens[y] += len;
+    row->chars[E.lens[y]] = '\0';
+    update_row(y);
+    mark_dirty();
+    journal_record(J_APPEND, y, 0, s, len);
+}
+
+void truncate_row(size_t y, size_t len) {
+    struct erow *row = &E.rows[y];
+
+    if (len >= E.lens[y]) {
+        return;
+    }
+
+    thaw_row(y);
+    undo_record(J_TRUNCATE, y, len, &row->chars[len], E.lens[y] - len);
+    E.lens[y] = len;
+    row->chars[len] = '\0';
+
+    update_row(y);
+    mark_dirty();
+    journal_record(J_TRUNCATE, y, len, NULL, 0);
+}
+
+void insert_string_at_row(size_t y, size_t at, char *s, size_t len) {
+    struct erow *row = &E.rows[y];
+
+    if (at > E.lens[y]) {
+        at = E.lens[y];
+    }
+
+    thaw_row(y);
+    row->chars = realloc(row->chars, E.lens[y] + len + 1);
+    memmove(&row->chars[at + len], &row->chars[at], E.lens[y] - at + 1);
+    memcpy(&row->chars[at], s, len);
+    E.lens[y] += len;
+
+    update_row(y);
+    mark_dirty();
+    undo_record(J_INSERT_STRING, y, at, s, len);
+    journal_record(J_INSERT_STRING, y, at, s, len);
+}
+
+void delete_string_at_row(size_t y, size_t at, size_t len) {
+    struct erow *row = &E.rows[y];
+
+    if (at >= E.lens[y]) {
+        return;
+    }
+
+    if (len > E.lens[y] - at) {
+        len = E.lens[y] - at;
+    }
+
+    thaw_row(y);
+    undo_record(J_DELETE_STRING, y, at, &row->chars[at], len);
+    journal_record(J_DELETE_STRING, y, at, &row->chars[at], len);
+    memmove(&row->chars[at], &row->chars[at + len], E.lens[y] - at - len + 1);
+    E.lens[y] -= len;
+
+    update_row(y);
+    mark_dirty();
+}
+
+// Applies records forward (redo) or their inverse (undo). Runs of row
+// insertions and deletions are applied as one block.
+size_t undo_apply(struct eundo_rec *recs, size_t count, bool forward) {
+    struct eundo_rec *rec = &recs[0];
+    size_t num = 1;
+    bool rows = (rec->op == J_INSERT_ROW || rec->op == J_DELETE_ROW);
+
+    while (rows && num < count && recs[num].op == rec->op) {
+        size_t expected = rec->row;
+
+        // Inserted rows are consecutive, deleted rows all leave the same index.
+        if (rec->op == J_INSERT_ROW) {
+            expected = forward ? rec->row + num : rec->row - num;
+        }
+
+        if (recs[num].row != expected) {
+            break;
+        }
+
+        num++;
+    }
+
+    bool insert = (rec->op == J_INSERT_ROW) == forward;
+
+    if (rows && insert) {
+        struct eslice *slices = malloc(num * sizeof(struct eslice));
+
+        for (size_t i = 0; i < num; i++) {
+            struct eundo_rec *r = forward ? &recs[i] : &recs[num - 1 - i];
+            slices[i].chars = r->data;
+            slices[i].len = r->len;
+        }
+
+        insert_rows(forward ? rec->row : recs[num - 1].row, slices, num);
+        free(slices);
+        return num;
+    }
+
+    if (rows) {
+        delete_rows(forward ? rec->row : recs[num - 1].row, num);
+        return num;
+    }
+
+    if (rec->row >= E.lines) {
+        return 1;
+    }
+
+    size_t row = rec->row;
+
+    switch (rec->op) {
+        case J_INSERT_CHAR:
+        case J_INSERT_STRING:
+            if (forward) {
+                insert_string_at_row(row, rec->at, rec->data, rec->len);
+            } else {
+                delete_string_at_row(row, rec->at, rec->len);
+            }
+
+            break;
+
+        case J_DELETE_CHAR:
+        case J_DELETE_STRING:
+            if (forward) {
+                delete_string_at_row(row, rec->at, rec->len);
+            } else {
+                insert_string_at_row(row, rec->at, rec->data, rec->len);
+            }
+
+            break;
+
+        case J_APPEND:
+            if (forward) {
+                append_string_at_row(row, rec->data, rec->len);
+            } else {
+                truncate_row(row, rec->at);
+            }
+
+            break;
+
+        case J_TRUNCATE:
+            if (forward) {
+                truncate_row(row, rec->at);
+            } else {
+                append_string_at_row(row, rec->data, rec->len);
+            }
+
+            break;
+    }
+
+    return 1;
+}
+
+void undo_move_cursor(size_t x, size_t y) {
+    E.y = (y > E.lines) ? E.lines : y;
+    E.x = x;
+
+    size_t len = (E.y < E.lines) ? E.lens[E.y] : 0;
+
+    if (E.x > len) {
+        E.x = len;
+    }
+}
+
+void undo(bool forward) {
+    struct eundo *u = &E.undo;
+    struct eundo_rec rec;
+
+    bool found = forward ? undo_decode(u->pos, &rec) : undo_before(u->pos, &rec);
+
+    if (!found) {
+        set_message(forward ? "Already at newest change." : "Already at oldest change.");
+        return;
+    }
+
+    uint64_t group = rec.group;
+    size_t pos = u->pos;
+    size_t count = 0;
+    size_t cap = 16;
+    struct eundo_rec *recs = malloc(cap * sizeof(struct eundo_rec));
+
+    // Undo walks the group backwards from pos, redo walks it forwards.
+    while (forward ? undo_decode(pos, &rec) : undo_before(pos, &rec)) {
+        if (rec.group != group) {
+            break;
+        }
+
+        if (count == cap) {
+            cap *= 2;
+            recs = realloc(recs, cap * sizeof(struct eundo_rec));
+        }
+
+        recs[count++] = rec;
+        pos = forward ? undo_end_of(&rec) : rec.start;
+    }
+
+    u->applying = true;
+
+    for (size_t i = 0; i < count; ) {
+        i += undo_apply(&recs[i], count - i, forward);
+    }
+
+    u->applying = false;
+    u->pos = pos;
+
+    if (forward) {
+        undo_move_cursor(recs[count - 1].ax, recs[count - 1].ay);
+    } else {
+        undo_move_cursor(recs[count - 1].cx, recs[count - 1].cy);
+    }
+
+    free(recs);
+}
+
+void insert_char(uint16_t c) {
+    if (E.y == E.lines) {
+        insert_row(E.lines, "", 0);
+    }
+
+    insert_char_at_row(E.y, E.x, c);
+    E.x++;
+}
+
+void insert_newline() {
+    if (E.x == 0) {
+        insert_row(E.y, "", 0);
+    } else {
+        unpack_row(E.y);
+        struct erow *row = &E.rows[E.y];
+        insert_row(E.y + 1, &row->chars[E.x], E.lens[E.y] - E.x);
+
+        truncate_row(E.y, E.x);
+    }
+
+    E.y++;
+    E.x = 0;
+}
+
+void delete_char() {
+    if ((E.x == 0 && E.y == 0) || E.y == E.lines) {
+        return;
+    }
+
+    if (E.x > 0) {
+        size_t at = cell_x(E.y, E.x - 1);
+
+        if (E.x - at == 1) {
+            delete_char_at_row(E.y, at);
+        } else {
+            delete_string_at_row(E.y, at, E.x - at);
+        }
+
+        E.x = at;
+    } else {
+        E.x = E.lens[E.y - 1];
+        unpack_row(E.y);
+        append_string_at_row(E.y - 1, E.rows[E.y].chars, E.lens[E.y]);
+        delete_row(E.y);
+        E.y--;
+    }
+}
+
+bool journal_apply(uint8_t op, size_t a, size_t b, char *s, size_t len) {
+    bool in_row = (a < E.lines);
+
+    // Commands are replayed by name over rows [a, b).
+    if (op == J_COMMAND) {
+        char name[8];
+
+        if (a > b || b > E.lines || len >= sizeof(name)) {
+            return false;
+        }
+
+        memcpy(name, s, len);
+        name[len] = '\0';
+
+        return apply_command(name, a, b);
+    }
+
+    switch (op) {
+        case J_INSERT_ROW:
+            if (a > E.lines) {
+                return false;
+            }
+
+            insert_row(a, s, len);
+            return true;
+
+        case J_DELETE_ROW:
+            if (!in_row) {
+                return false;
+            }
+
+            delete_row(a);
+            return true;
+
+        case J_INSERT_CHAR:
+            if (!in_row || len != 1) {
+                return false;
+            }
+
+            insert_char_at_row(a, b, (uint8_t) s[0]);
+            return true;
+
+        case J_DELETE_CHAR:
+            if (!in_row) {
+                return false;
+            }
+
+            delete_char_at_row(a, b);
+            return true;
+
+        case J_APPEND:
+            if (!in_row) {
+                return false;
+            }
+
+            append_string_at_row(a, s, len);
+            return true;
+
+        case J_TRUNCATE:
+            if (!in_row) {
+                return false;
+            }
+
+            truncate_row(a, b);
+            return true;
+
+        case J_INSERT_STRING:
+            if (!in_row) {
+                return false;
+            }
+
+            insert_string_at_row(a, b, s, len);
+            return true;
+
+        case J_DELETE_STRING:
+            if (!in_row) {
+                return false;
+            }
+
+            delete_string_at_row(a, b, len);
+            return true;
+    }
+
+    return false;
+}
+
+// Replays the journal left behind by a session that did not exit cleanly.
+void journal_replay() {
+    char *path = sidecar_path(E.filename, "nimj");
+    int32_t fd = open(path, O_RDWR);
+
+    if (fd == -1) {
+        free(path);
+        return;
+    }
+
+    struct ejheader header;
+    struct ejheader expected;
+    struct stat st;
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || journal_header(&expected, E.filename) == -1
+            || memcmp(&header, &expected, sizeof(header)) != 0
+            || fstat(fd, &st) == -1) {
+        close(fd);
+        unlink(path);
+        free(path);
+        set_message("Discarded a stale journal.");
+        return;
+    }
+
+    size_t size = st.st_size - sizeof(header);
+    char *buf = malloc(size + 1);
+
+    if (pread(fd, buf, size, sizeof(header)) != (ssize_t) size) {
+        size = 0;
+    }
+
+    size_t pos = 0;
+    size_t edits = 0;
+
+    while (pos < size) {
+        bool ok = true;
+        uint8_t op = buf[pos++];
+        size_t a = decode_number(buf, size, &pos, &ok);
+        size_t b = decode_number(buf, size, &pos, &ok);
+        size_t len = decode_number(buf, size, &pos, &ok);
+
+        // A torn record at the end is what an interrupted flush leaves.
+        if (!ok || len > size - pos || !journal_apply(op, a, b, &buf[pos], len)) {
+            break;
+        }
+
+        pos += len;
+        edits++;
+    }
+
+    free(buf);
+
+    E.journal.fd = fd;
+    E.journal.path = path;
+    E.journal.size = sizeof(header) + pos;
+    E.journal.flushed = time(NULL);
+    ftruncate(fd, E.journal.size);
+
+    if (edits > 0) {
+        set_message("Recovered %ld edits from %s.", edits, path);
+    }
+}
+
+void stop_follow() {
+    if (!E.follow.active) {
+        return;
+    }
+
+    close(E.follow.fd);
+    close(E.follow.file);
+    E.follow.active = false;
+}
+
+// Reads what was appended to the followed file since the last known
+// offset. Work is bounded per call so a burst of output cannot stall keys.
+bool follow_file(bool force) {
+    struct efollow *f = &E.follow;
+    char events[4096];
+    bool changed = force || f->pending;
+
+    while (read(f->fd, events, sizeof(events)) > 0) {
+        changed = true;
+    }
+
+    if (!changed) {
+        return false;
+    }
+
+    struct stat st;
+
+    if (fstat(f->file, &st) == -1) {
+        return false;
+    }
+
+    if ((size_t) st.st_size < f->offset) {
+        stop_follow();
+        set_message("File was truncated, follow mode off.");
+        return true;
+    }
+
+    bool at_end = (E.y + 1 >= E.lines);
+    size_t budget = NIM_FOLLOW_BURST;
+    char *buf = malloc(NIM_READ_CHUNK);
+
+    while (budget > 0) {
+        ssize_t len = pread(f->file, buf, NIM_READ_CHUNK, f->offset);
+
+        if (len <= 0) {
+            break;
+        }
+
+        append_bytes(buf, len);
+        f->offset += len;
+        budget = ((size_t) len < budget) ? budget - len : 0;
+    }
+
+    free(buf);
+
+    // There is more to read; the next poll picks it up without an event.
+    f->pending = (budget == 0);
+
+    if (at_end && E.lines > 0) {
+        E.y = E.lines - 1;
+        E.x = 0;
+    }
+
+    journal_touch();
+
+    return true;
+}
+
+// Opens the file and watches it for changes. Saving replaces the file, so
+// this is done again after every save.
+bool open_follow() {
+    int32_t file = open(E.filename, O_RDONLY);
+    int32_t fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (file == -1 || fd == -1 || inotify_add_watch(fd, E.filename, IN_MODIFY) == -1) {
+        int32_t error = errno;
+
+        if (file != -1) {
+            close(file);
+        }
+
+        if (fd != -1) {
+            close(fd);
+        }
+
+        errno = error;
+        return false;
+    }
+
+    E.follow.active = true;
+    E.follow.pending = false;
+    E.follow.fd = fd;
+    E.follow.file = file;
+
+    return true;
+}
+
+void start_follow() {
+    if (E.follow.active) {
+        stop_follow();
+        set_message("Follow mode off.");
+        return;
+    }
+
+    if (E.filename == NULL) {
+        set_message("Nothing to follow.");
+        return;
+    }
+
+    if (!open_follow()) {
+        set_message("Follow failed: %s", strerror(errno));
+        return;
+    }
+
+    // Catch up on anything appended since the file was opened.
+    follow_file(true);
+    set_message("Following %s (Ctrl-T to stop).", E.filename);
+}
+
+// Reads the input stream on its own thread, so keys keep working while a
+// slow producer is still writing.
+void *stream_worker(void *arg) {
+    struct estream *s = arg;
+    char *chunk = malloc(NIM_READ_CHUNK);
+
+    while (true) {
+        ssize_t len = read(s->fd, chunk, NIM_READ_CHUNK);
+
+        if (len == -1 && errno == EINTR) {
+            continue;
+        }
+
+        pthread_mutex_lock(&s->lock);
+
+        if (len <= 0) {
+            s->eof = true;
+            s->error = (len == -1) ? errno : 0;
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+
+        while (s->len >= NIM_STREAM_LIMIT) {
+            pthread_cond_wait(&s->drained, &s->lock);
+        }
+
+        if (s->len + len > s->cap) {
+            s->cap = (s->len + len) * 2;
+            s->buf = realloc(s->buf, s->cap);
+        }
+
+        memcpy(&s->buf[s->len], chunk, len);
+        s->len += len;
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    free(chunk);
+    return NULL;
+}
+
+bool poll_stream() {
+    struct estream *s = &E.stream;
+
+    if (!s->active) {
+        return false;
+    }
+
+    pthread_mutex_lock(&s->lock);
+
+    char *buf = s->buf;
+    size_t len = s->len;
+    bool eof = s->eof;
+
+    s->buf = NULL;
+    s->len = 0;
+    s->cap = 0;
+
+    pthread_cond_signal(&s->drained);
+    pthread_mutex_unlock(&s->lock);
+
+    append_bytes(buf, len);
+    free(buf);
+    s->total += len;
+
+    if (!eof) {
+        if (len == 0) {
+            return false;
+        }
+
+        set_message("Reading stdin... %ld lines, %ld bytes", E.lines, s->total);
+        return true;
+    }
+
+    pthread_join(s->thread, NULL);
+    close(s->fd);
+    s->active = false;
+
+    if (s->error != 0) {
+        set_message("Read failed after %ld bytes: %s", s->total, strerror(s->error));
+    } else {
+        set_message("Read %ld lines, %ld bytes from stdin.", E.lines, s->total);
+    }
+
+    return true;
+}
+
+// Keeps the piped input on its own descriptor and reads keys from the
+// terminal instead. Must run before the terminal is put in raw mode.
+int32_t take_stdin() {
+    int32_t fd = dup(STDIN_FILENO);
+    int32_t tty = open("/dev/tty", O_RDWR);
+
+    if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) {
+        perror("/dev/tty");
+        exit(1);
+    }
+
+    close(tty);
+    return fd;
+}
+
+void open_stream(int32_t fd) {
+    struct estream *s = &E.stream;
+
+    s->fd = fd;
+    s->buf = NULL;
+    s->len = 0;
+    s->cap = 0;
+    s->eof = false;
+    s->error = 0;
+    s->total = 0;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->drained, NULL);
+
+    if (pthread_create(&s->thread, NULL, stream_worker, s) != 0) {
+        die("pthread_create");
+    }
+
+    s->active = true;
+    set_message("Reading stdin...");
+}
+
+int8_t write_iov(int32_t fd, struct iovec *iov, int32_t count) {
+    while (count > 0) {
+        ssize_t num = writev(fd, iov, count);
+
+        if (num == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        // Skip the fully written vectors, then trim the partial one.
+        while (count > 0 && (size_t) num >= iov->iov_len) {
+            num -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + num;
+            iov->iov_len -= num;
+        }
+    }
+
+    return 0;
+}
+
+int32_t open_temp_file(char *path, char **tmp) {
+    size_t size = strlen(path) + 12;
+    *tmp = malloc(size);
+    snprintf(*tmp, size, "%s.nimXXXXXX", path);
+
+    int32_t fd = mkstemp(*tmp);
+
+    if (fd == -1) {
+        free(*tmp);
+        *tmp = NULL;
+        return -1;
+    }
+
+    // Keep the permissions of the file we are replacing.
+    struct stat st;
+    mode_t mode;
+
+    if (stat(path, &st) == 0) {
+        mode = st.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0644 & ~mask;
+    }
+
+    fchmod(fd, mode);
+
+    return fd;
+}
+
+uint64_t hash_bytes(uint64_t hash, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) s[i];
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
+uint64_t hash_word(uint64_t hash, const char *s) {
+    uint64_t word;
+    memcpy(&word, s, sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3;
+
+    return hash ^ (hash >> 32);
+}
+
+// Eight bytes at a time, for hashing whole files.
+uint64_t hash_words(uint64_t hash, const char *s, size_t len) {
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        hash = hash_word(hash, &s[i]);
+    }
+
+    return hash_bytes(hash, &s[i], len - i);
+}
+
+void hash_stream(struct ewatch_stream *h, const char *s, size_t len) {
+    while (len > 0) {
+        size_t room = NIM_WATCH_BLOCK - h->pos;
+        size_t n = (len < room) ? len : room;
+        size_t i = 0;
+
+        while (h->nword > 0 && h->nword < 8 && i < n) {
+            h->word[h->nword++] = s[i++];
+        }
+
+        if (h->nword == 8) {
+            h->hash = hash_word(h->hash, h->word);
+            h->nword = 0;
+        }
+
+        for (; i + 8 <= n; i += 8) {
+            h->hash = hash_word(h->hash, &s[i]);
+        }
+
+        while (i < n) {
+            h->word[h->nword++] = s[i++];
+        }
+
+        h->pos += n;
+        s += n;
+        len -= n;
+
+        if (h->pos == NIM_WATCH_BLOCK) {
+            h->blocks[h->nblocks++] = h->hash;
+            h->hash = 0xcbf29ce484222325;
+            h->pos = 0;
+        }
+    }
+}
+
+// Hashes the short last block, if there is one.
+void hash_stream_end(struct ewatch_stream *h) {
+    if (h->pos > 0) {
+        h->blocks[h->nblocks++] = hash_bytes(h->hash, h->word, h->nword);
+        h->hash = 0xcbf29ce484222325;
+        h->pos = 0;
+        h->nword = 0;
+    }
+}
+
+// Hashes the size, the head, the tail and evenly spaced blocks in between,
+// so validating a multi-GB file reads a few hundred KB instead of all of it.
+uint64_t sample_hash(const char *map, size_t size) {
+    uint64_t hash = hash_bytes(0xcbf29ce484222325, (char *) &size, sizeof(size));
+    size_t block = NIM_INDEX_BLOCK;
+
+    if (size <= block * (NIM_INDEX_SAMPLES + 2)) {
+        return hash_bytes(hash, map, size);
+    }
+
+    hash = hash_bytes(hash, map, block);
+
+    for (size_t i = 1; i <= NIM_INDEX_SAMPLES; i++) {
+        hash = hash_bytes(hash, &map[(size - block) / (NIM_INDEX_SAMPLES + 1) * i], block);
+    }
+
+    return hash_bytes(hash, &map[size - block], block);
+}
+
+void index_header(struct eiheader *header, struct stat *st, uint64_t hash) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, NIM_INDEX_MAGIC, sizeof(header->magic));
+    header->version = NIM_INDEX_VERSION;
+    header->size = st->st_size;
+    header->mtime = st->st_mtim.tv_sec;
+    header->mtime_nsec = st->st_mtim.tv_nsec;
+    header->hash = hash;
+    header->lines = E.lines;
+    header->syntax = E.syntax ? (E.syntax - HLDB) + 1 : 0;
+    header->partial = (E.partial != SIZE_MAX);
+}
+
+// Builds the rows straight from a mapping of the file, using the line
+// lengths and comment states stored in the sidecar index.
+bool load_index(int32_t fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || st.st_size < NIM_INDEX_MIN) {
+        return false;
+    }
+
+    char *path = sidecar_path(E.filename, "nimi");
+    int32_t ifd = open(path, O_RDONLY);
+    free(path);
+
+    if (ifd == -1) {
+        return false;
+    }
+
+    struct eiheader header;
+    struct eiheader expected;
+    struct stat ist;
+    size_t size = st.st_size;
+
+    // Every line takes at least its newline, except maybe the last.
+    if (pread(ifd, &header, sizeof(header), 0) != sizeof(header) || fstat(ifd, &ist) == -1
+            || header.lines > size + 1) {
+        close(ifd);
+        return false;
+    }
+
+    index_header(&expected, &st, header.hash);
+    expected.lines = header.lines;
+    expected.partial = header.partial;
+
+    char *map = MAP_FAILED;
+
+    if (memcmp(&header, &expected, sizeof(header)) == 0) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    if (map == MAP_FAILED || sample_hash(map, size) != header.hash) {
+        if (map != MAP_FAILED) {
+            munmap(map, size);
+        }
+
+        close(ifd);
+        return false;
+    }
+
+    size_t len = ist.st_size - sizeof(header);
+    char *buf = malloc(len + 1);
+    bool ok = (pread(ifd, buf, len, sizeof(header)) == (ssize_t) len);
+    close(ifd);
+
+    size_t pos = 0;
+    size_t offset = 0;
+
+    reserve_rows(header.lines);
+
+    for (size_t i = 0; ok && i < header.lines; i++) {
+        size_t rlen = decode_number(buf, len, &pos, &ok);
+        size_t meta = decode_number(buf, len, &pos, &ok);
+
+        if (!ok || rlen > size - offset || (meta >> 1) > size - offset - rlen) {
+            ok = false;
+            break;
+        }
+
+        struct erow *row = &E.rows[i];
+        E.lens[i] = rlen;
+        E.comments[i] = meta & 1;
+        row->mapped = true;
+        row->snap = 0;
+        row->used = 0;
+        row->chars = &map[offset];
+        row->render = NULL;
+        row->rlen = 0;
+        row->spans = NULL;
+        row->nspans = 0;
+        row->cells = NULL;
+        row->ncells = 0;
+        row->block = NULL;
+
+        offset += rlen + (meta >> 1);
+    }
+
+    free(buf);
+
+    if (!ok || offset != size) {
+        munmap(map, size);
+        return false;
+    }
+
+    E.lines = header.lines;
+    E.partial = header.partial ? header.lines - 1 : SIZE_MAX;
+    E.map = map;
+    E.mapsize = size;
+    E.follow.offset = size;
+
+    update_gutter();
+
+    return true;
+}
+
+// Stores the line lengths, the bytes that end each line and the comment
+// state of every row next to the file, so the next open skips the scan.
+void save_index(int32_t fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || st.st_size < NIM_INDEX_MIN) {
+        return;
+    }
+
+    size_t size = st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    size_t cap = E.lines * 4 + sizeof(struct eiheader);
+    size_t len = sizeof(struct eiheader);
+    char *buf = malloc(cap);
+    size_t offset = 0;
+    bool ok = true;
+
+    for (size_t i = 0; ok && i < E.lines; i++) {
+        size_t end = offset + E.lens[i];
+        size_t skip = 0;
+
+        while (end + skip < size && map[end + skip] == '\r') {
+            skip++;
+        }
+
+        if (end + skip < size && map[end + skip] == '\n') {
+            skip++;
+        } else if (end != size) {
+            ok = false;
+        }
+
+        if (len + 20 > cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+
+        len += encode_number(&buf[len], E.lens[i]);
+        len += encode_number(&buf[len], (skip << 1) | E.comments[i]);
+        offset = end + skip;
+    }
+
+    if (ok && offset == size) {
+        index_header((struct eiheader *) buf, &st, sample_hash(map, size));
+
+        char *path = sidecar_path(E.filename, "nimi");
+        char *tmp;
+        int32_t ifd = open_temp_file(path, &tmp);
+
+        if (ifd != -1) {
+            struct iovec iov = { buf, len };
+
+            if (write_iov(ifd, &iov, 1) != -1 && close(ifd) != -1) {
+                rename(tmp, path);
+            } else {
+                unlink(tmp);
+            }
+
+            free(tmp);
+        }
+
+        free(path);
+    }
+
+    free(buf);
+    munmap(map, size);
+}
+
+void *watch_worker(void *arg) {
+    struct ewatch_job *job = arg;
+
+    for (size_t i = job->lo; i < job->hi; i++) {
+        size_t at = i * NIM_WATCH_BLOCK;
+        size_t len = (job->limit - at < NIM_WATCH_BLOCK) ? job->limit - at : NIM_WATCH_BLOCK;
+        job->hashes[i] = hash_words(0xcbf29ce484222325, &job->map[at], len);
+    }
+
+    return NULL;
+}
+
+// Hashes the blocks from first to nblocks of the first limit bytes of
+// map, one range of blocks per core.
+void hash_blocks(const char *map, size_t limit, uint64_t *hashes, size_t first, size_t nblocks) {
+    size_t count = nblocks - first;
+    size_t n = (count < worker_count()) ? count : worker_count();
+    struct ewatch_job *jobs = calloc(n ? n : 1, sizeof(struct ewatch_job));
+
+    for (size_t i = 0; i < n; i++) {
+        jobs[i] = (struct ewatch_job) {
+            .map = map, .limit = limit, .lo = first + count * i / n, .hi = first + count * (i + 1) / n,
+            .hashes = hashes,
+        };
+        jobs[i].started = (n > 1 && pthread_create(&jobs[i].thread, NULL, watch_worker, &jobs[i]) == 0);
+
+        if (!jobs[i].started) {
+            watch_worker(&jobs[i]);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (jobs[i].started) {
+            pthread_join(jobs[i].thread, NULL);
+        }
+    }
+
+    free(jobs);
+}
+
+void *watch_hasher(void *arg) {
+    struct ewatch_hasher *h = arg;
+    char *buf = malloc(NIM_WATCH_BLOCK);
+    struct stat st;
+
+    h->ok = true;
+
+    for (size_t i = 0; i < h->nblocks && h->ok; i++) {
+        size_t at = i * NIM_WATCH_BLOCK;
+        size_t len = (h->size - at < NIM_WATCH_BLOCK) ? h->size - at : NIM_WATCH_BLOCK;
+
+        h->ok = !atomic_load(&h->cancel) && pread(h->fd, buf, len, at) == (ssize_t) len;
+        h->blocks[i] = hash_words(0xcbf29ce484222325, buf, len);
+    }
+
+    h->ok = h->ok && fstat(h->fd, &st) == 0 && (size_t) st.st_size == h->size
+        && st.st_mtim.tv_sec == h->mtime.tv_sec && st.st_mtim.tv_nsec == h->mtime.tv_nsec;
+
+    free(buf);
+    close(h->fd);
+    atomic_store(&h->done, true);
+
+    return NULL;
+}
+
+// Starts hashing the blocks of the file as last read, unless they are
+// already known.
+void watch_hash(int32_t fd) {
+    struct ewatch *w = &E.watch;
+
+    if (S.headless || w->blocks != NULL || w->hasher != NULL || w->size == 0) {
+        return;
+    }
+
+    struct ewatch_hasher *h = malloc(sizeof(struct ewatch_hasher));
+    h->fd = dup(fd);
+    h->size = w->size;
+    h->mtime = w->mtime;
+    h->nblocks = (w->size + NIM_WATCH_BLOCK - 1) / NIM_WATCH_BLOCK;
+    h->blocks = malloc(h->nblocks * sizeof(uint64_t));
+    atomic_init(&h->cancel, false);
+    atomic_init(&h->done, false);
+
+    if (h->fd == -1 || pthread_create(&h->thread, NULL, watch_hasher, h) != 0) {
+        if (h->fd != -1) {
+            close(h->fd);
+        }
+
+        free(h->blocks);
+        free(h);
+        return;
+    }
+
+    w->hasher = h;
+}
+
+// Takes the block hashes once the hasher is done; cancel stops it and
+// drops them.
+void watch_collect(bool cancel) {
+    struct ewatch *w = &E.watch;
+    struct ewatch_hasher *h = w->hasher;
+
+    if (h == NULL || (!cancel && !atomic_load(&h->done))) {
+        return;
+    }
+
+    atomic_store(&h->cancel, cancel);
+    pthread_join(h->thread, NULL);
+    w->hasher = NULL;
+
+    if (!cancel && h->ok && h->size == w->size) {
+        free(w->blocks);
+        w->blocks = h->blocks;
+        w->nblocks = h->nblocks;
+    } else {
+        free(h->blocks);
+    }
+
+    free(h);
+}
+
+// Records the file as read. Reading a file never hashes all of it: the
+// block hashes are dropped, except after an append to a file whose block
+// hashes are known, where only the blocks from the old end on are hashed.
+void watch_update(struct stat *st, char *map, bool appended) {
+    struct ewatch *w = &E.watch;
+    size_t first = w->size / NIM_WATCH_BLOCK;
+    bool known = appended && (w->blocks != NULL || w->size == 0);
+
+    watch_collect(true);
+
+    w->dev = st->st_dev;
+    w->ino = st->st_ino;
+    w->size = st->st_size;
+    w->mtime = st->st_mtim;
+    w->hash = (w->size > 0) ? sample_hash(map, w->size) : 0;
+    w->nblocks = known ? (w->size + NIM_WATCH_BLOCK - 1) / NIM_WATCH_BLOCK : 0;
+
+    if (known) {
+        w->blocks = realloc(w->blocks, (w->nblocks ? w->nblocks : 1) * sizeof(uint64_t));
+        hash_blocks(map, w->size, w->blocks, first, w->nblocks);
+    } else {
+        free(w->blocks);
+        w->blocks = NULL;
+    }
+
+    w->checked = time(NULL);
+    w->warned = false;
+}
+
+// Returns how many leading bytes of the old contents map still has, to
+// the block.
+size_t watch_prefix(char *map, size_t size) {
+    struct ewatch *w = &E.watch;
+    size_t limit = (size < w->size) ? size : w->size;
+    size_t nblocks = (limit + NIM_WATCH_BLOCK - 1) / NIM_WATCH_BLOCK;
+    uint64_t *hashes = malloc((nblocks ? nblocks : 1) * sizeof(uint64_t));
+    size_t i = 0;
+
+    hash_blocks(map, limit, hashes, 0, nblocks);
+
+    // A short last block only matches if the file did not shrink into it.
+    while (i < nblocks && hashes[i] == w->blocks[i]
+            && ((i + 1) * NIM_WATCH_BLOCK <= limit || limit == w->size)) {
+        i++;
+    }
+
+    free(hashes);
+
+    return (i == nblocks) ? limit : i * NIM_WATCH_BLOCK;
+}
+
+void watch_reset(int32_t fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        return;
+    }
+
+    size_t size = st.st_size;
+    char *map = (size > 0) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    watch_update(&st, map, false);
+
+    if (map) {
+        munmap(map, size);
+    }
+}
+
+// Takes the block hashes a save made of what it wrote, unless the file
+// changed again since.
+void watch_saved(int32_t fd, struct ewatch_stream *hashes) {
+    struct ewatch *w = &E.watch;
+
+    watch_reset(fd);
+
+    if (w->size == 0 || hashes->nblocks != (w->size + NIM_WATCH_BLOCK - 1) / NIM_WATCH_BLOCK) {
+        return;
+    }
+
+    free(w->blocks);
+    w->blocks = hashes->blocks;
+    w->nblocks = hashes->nblocks;
+    hashes->blocks = NULL;
+}
+
+// Length of a line without the carriage returns before its newline.
+size_t line_length(char *s, size_t len, bool newline) {
+    while (newline && len > 0 && s[len - 1] == '\r') {
+        len--;
+    }
+
+    return len;
+}
+
+bool same_row(size_t y, char *s, size_t len) {
+    unpack_row(y);
+
+    return E.lens[y] == len && memcmp(E.rows[y].chars, s, len) == 0;
+}
+
+// Replaces rows [at, at + count) with the lines in buf, without recording
+// it. The rows below are highlighted again only while their comment state
+// changes.
+void replace_rows(size_t at, size_t count, char *buf, size_t len) {
+    size_t n = 0;
+    size_t cap = 64;
+    struct eslice *rows = malloc(cap * sizeof(struct eslice));
+
+    for (size_t i = 0; i < len;) {
+        char *nl = memchr(&buf[i], '\n', len - i);
+        size_t end = nl ? (size_t) (nl - buf) : len;
+
+        if (n == cap) {
+            cap *= 2;
+            rows = realloc(rows, cap * sizeof(struct eslice));
+        }
+
+        rows[n].chars = &buf[i];
+        rows[n].len = line_length(&buf[i], end - i, nl != NULL);
+        n++;
+
+        i = nl ? end + 1 : len;
+    }
+
+    remove_rows(at, count);
+    splice_rows(at, rows, n);
+    free(rows);
+
+    for (size_t y = at; y <= at + n && y < E.lines; y++) {
+        update_row(y);
+    }
+
+    // The cursor and the view stay on the same text when rows above it
+    // were replaced.
+    if (E.y >= at + count) {
+        E.y = E.y - count + n;
+    } else if (E.y > at + n) {
+        E.y = at + n;
+    }
+
+    if (E.rowoff >= at + count) {
+        E.rowoff = E.rowoff - count + n;
+    } else if (E.rowoff > at + n) {
+        E.rowoff = at + n;
+    }
+
+    update_gutter();
+}
+
+// Reads a file that changed on disk into a clean buffer. A file that grew
+// with the sampled hash of its old size intact, and its old blocks too
+// once their hashes are known, is taken as appended to and only the new
+// tail is read. Otherwise the rows that match at the top and bottom are
+// kept, with their highlighting, and only the lines between them are
+// replaced. Rows in unchanged leading blocks are not compared.
+bool reload_file() {
+    struct ewatch *w = &E.watch;
+    uint64_t start = now_us();
+    int32_t fd = open(E.filename, O_RDONLY);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+
+        return false;
+    }
+
+    size_t size = st.st_size;
+    char *map = (size > 0) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+
+    if (map == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    watch_collect(false);
+
+    size_t removed = 0;
+    size_t added = 0;
+    bool sampled = (size >= w->size) && (w->size > 0 ? sample_hash(map, w->size) == w->hash : E.lines == 0);
+    bool known = (w->blocks != NULL || w->size == 0);
+    size_t same = (sampled && known) ? watch_prefix(map, size) : 0;
+    bool appended = (size > w->size) && sampled && (!known || same == w->size);
+
+    if (appended) {
+        added = E.lines;
+        append_bytes(&map[w->size], size - w->size);
+        added = E.lines - added;
+    } else {
+        // Rows borrowed from a mapping of a file rewritten in place already
+        // show the new bytes, so none of them can be trusted.
+        bool borrowed = E.map && st.st_dev == w->dev && st.st_ino == w->ino;
+        size_t top = 0;
+        size_t bottom = 0;
+        size_t off = 0;
+        size_t tail = size;
+
+        while (!borrowed && top < E.lines && off < size) {
+            // Rows in the unchanged blocks need no comparing.
+            if (off + E.lens[top] < same && map[off + E.lens[top]] == '\n') {
+                off += E.lens[top] + 1;
+                top++;
+                continue;
+            }
+
+            char *nl = memchr(&map[off], '\n', size - off);
+            size_t end = nl ? (size_t) (nl - map) : size;
+
+            if (!same_row(top, &map[off], line_length(&map[off], end - off, nl != NULL))) {
+                break;
+            }
+
+            top++;
+            off = nl ? end + 1 : size;
+        }
+
+        while (!borrowed && bottom < E.lines - top && tail > off) {
+            bool newline = (map[tail - 1] == '\n');
+            size_t end = newline ? tail - 1 : tail;
+            char *nl = memrchr(&map[off], '\n', end - off);
+            size_t from = nl ? (size_t) (nl - map) + 1 : off;
+
+            if (!same_row(E.lines - 1 - bottom, &map[from], line_length(&map[from], end - from, newline))) {
+                break;
+            }
+
+            bottom++;
+            tail = from;
+        }
+
+        removed = E.lines - top - bottom;
+        added = E.lines;
+        replace_rows(top, removed, &map[off], tail - off);
+        added = E.lines - added + removed;
+
+        if (borrowed) {
+            munmap(E.map, E.mapsize);
+            E.map = NULL;
+            E.mapsize = 0;
+        }
+
+        undo_clear();
+    }
+
+    E.partial = (size > 0 && map[size - 1] != '\n') ? E.lines - 1 : SIZE_MAX;
+    E.follow.offset = size;
+    watch_update(&st, map, appended);
+    watch_hash(fd);
+    close(fd);
+
+    if (map) {
+        munmap(map, size);
+    }
+
+    if (E.y < E.lines && E.x > E.lens[E.y]) {
+        E.x = E.lens[E.y];
+    }
+
+    // The journal belonged to the old contents.
+    journal_close(true);
+
+    set_message("%s changed on disk: %ld rows replaced by %ld (%.1f ms)", E.filename,
+            removed, added, (now_us() - start) / 1000.0);
+
+    return true;
+}
+
+// Notices when another process changed the file. Clean buffers take the
+// new contents; buffers with unsaved changes keep them and get a warning.
+bool check_file() {
+    struct ewatch *w = &E.watch;
+    time_t now = time(NULL);
+    struct stat st;
+
+    watch_collect(false);
+
+    if (E.filename == NULL || E.hex.binary || E.follow.active || E.save.active
+            || E.stream.active || now - w->checked < NIM_WATCH_INTERVAL) {
+        return false;
+    }
+
+    w->checked = now;
+
+    if (stat(E.filename, &st) == -1 || (st.st_dev == w->dev && st.st_ino == w->ino
+            && (size_t) st.st_size == w->size && st.st_mtim.tv_sec == w->mtime.tv_sec
+            && st.st_mtim.tv_nsec == w->mtime.tv_nsec)) {
+        return false;
+    }
+
+    if (!E.dirty) {
+        return reload_file();
+    }
+
+    if (w->warned) {
+        return false;
+    }
+
+    w->warned = true;
+    set_message("%s changed on disk; saving will overwrite it", E.filename);
+
+    return true;
+}
+
+bool map_hex(int32_t fd) {
+    struct ehex *h = &E.hex;
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        return false;
+    }
+
+    h->size = st.st_size;
+    h->map = NULL;
+
+    if (h->size > 0) {
+        h->map = mmap(NULL, h->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (h->map == MAP_FAILED) {
+            h->map = NULL;
+            return false;
+        }
+    }
+
+    h->digits = 8;
+
+    while (h->digits < 16 && (h->size >> (h->digits * 4)) > 0) {
+        h->digits++;
+    }
+
+    h->active = true;
+    h->pos = 0;
+    h->rowoff = 0;
+
+    return true;
+}
+
+void open_file(char *filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    int32_t fd = open(filename, O_RDONLY);
+
+    if (fd == -1) {
+        die("open");
+    }
+
+    // Binary files are not split into rows at all.
+    char head[NIM_BINARY_PROBE];
+    ssize_t probe = pread(fd, head, sizeof(head), 0);
+
+    if (probe > 0 && memchr(head, '\0', probe) != NULL) {
+        if (!map_hex(fd)) {
+            die("mmap");
+        }
+
+        E.hex.binary = true;
+        close(fd);
+        return;
+    }
+
+    select_syntax();
+
+    E.partial = SIZE_MAX;
+    E.follow.offset = 0;
+
+    if (!load_index(fd)) {
+        char *buf = malloc(NIM_READ_CHUNK);
+        ssize_t len;
+
+        while ((len = read(fd, buf, NIM_READ_CHUNK)) != 0) {
+            if (len == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                die("read");
+            }
+
+            append_bytes(buf, len);
+            E.follow.offset += len;
+        }
+
+        free(buf);
+        save_index(fd);
+    }
+
+    watch_reset(fd);
+    watch_hash(fd);
+    close(fd);
+    E.dirty = false;
+
+    // Scripted and replayed runs leave the journal of a crashed session
+    // for the user to recover.
+    if (!S.headless && S.trace.in == NULL) {
+        journal_replay();
+    }
+}
+
+// Rows are hashed in blocks as they are written, so the next reload can
+// tell an append from an edit without reading the saved file back.
+int8_t write_rows(struct esave *save, struct eslice *rows, size_t lines) {
+    struct iovec iov[NIM_IOV_BATCH * 2];
+    int32_t count = 0;
+    size_t size = 0;
+
+    for (size_t i = 0; i < lines; i++) {
+        hash_stream(&save->hashes, rows[i].chars, rows[i].len);
+        hash_stream(&save->hashes, "\n", 1);
+
+        iov[count].iov_base = rows[i].chars;
+        iov[count].iov_len = rows[i].len;
+        count++;
+
+        iov[count].iov_base = "\n";
+        iov[count].iov_len = 1;
+        count++;
+
+        size += rows[i].len + 1;
+
+        if (count == NIM_IOV_BATCH * 2 || i + 1 == lines) {
+            if (write_iov(save->fd, iov, count) == -1) {
+                return -1;
+            }
+
+            atomic_fetch_add(&save->written, size);
+            count = 0;
+            size = 0;
+        }
+    }
+
+    return 0;
+}
+
+// Packed rows are decompressed one block at a time into a scratch buffer,
+// so saving never unpacks the buffer itself.
+int8_t write_snapshot(struct esave *save) {
+    char *scratch = NULL;
+    size_t next = 0;
+    size_t i = 0;
+    int8_t status = 0;
+
+    while (i < save->lines && status != -1) {
+        size_t end = (next < save->npacked) ? save->packed[next].at : save->lines;
+
+        if (i < end) {
+            status = write_rows(save, &save->rows[i], end - i);
+            i = end;
+            continue;
+        }
+
+        struct eblock *block = save->packed[next++].block;
+        scratch = realloc(scratch, block->raw + 1);
+        lz_decompress((uint8_t *) block->data, block->size, (uint8_t *) scratch);
+
+        for (size_t k = 0, offset = 0; k < block->lines; k++) {
+            save->rows[i + k].chars = &scratch[offset];
+            offset += save->rows[i + k].len;
+        }
+
+        status = write_rows(save, &save->rows[i], block->lines);
+        i += block->lines;
+    }
+
+    hash_stream_end(&save->hashes);
+    free(scratch);
+
+    return status;
+}
+
+void *save_worker(void *arg) {
+    struct esave *save = arg;
+    int8_t status = write_snapshot(save);
+
+    if (status != -1 && NIM_FSYNC && fsync(save->fd) == -1) {
+        status = -1;
+    }
+
+    if (close(save->fd) == -1) {
+        status = -1;
+    }
+
+    if (status != -1 && rename(save->tmp, save->path) == -1) {
+        status = -1;
+    }
+
+    save->error = (status == -1) ? errno : 0;
+
+    if (status == -1) {
+        unlink(save->tmp);
+    }
+
+    atomic_store(&save->done, true);
+    return NULL;
+}
+
+bool finish_save(bool wait) {
+    struct esave *save = &E.save;
+
+    if (!save->active) {
+        return false;
+    }
+
+    if (!wait && !atomic_load(&save->done)) {
+        size_t written = atomic_load(&save->written);
+        set_message("Saving... %ld%% (%ld/%ld bytes)",
+                save->size ? written * 100 / save->size : 100, written, save->size);
+        return true;
+    }
+
+    pthread_join(save->thread, NULL);
+
+    for (size_t i = 0; i < save->norphans; i++) {
+        free(save->orphans[i]);
+    }
+
+    free(save->orphans);
+    free(save->rows);
+    free(save->packed);
+    free(save->path);
+    free(save->tmp);
+
+    save->orphans = NULL;
+    save->norphans = 0;
+    save->rows = NULL;
+    save->packed = NULL;
+    save->active = false;
+
+    if (save->error == 0) {
+        // Edits made while the snapshot was written keep the buffer dirty.
+        E.dirty = (E.changes != save->changes);
+        journal_rebase(!E.dirty);
+
+        int32_t fd = open(E.filename, O_RDONLY);
+
+        if (fd != -1) {
+            watch_saved(fd, &save->hashes);
+            close(fd);
+        }
+
+        // Every saved row ends with a newline.
+        E.partial = SIZE_MAX;
+        set_message("%ld bytes written to disk.", save->size);
+
+        if (E.follow.active) {
+            stop_follow();
+
+            if (open_follow()) {
+                E.follow.offset = save->size;
+            } else {
+                set_message("%ld bytes written to disk; follow mode off.", save->size);
+            }
+        }
+    } else {
+        set_message("Save failed: %s", strerror(save->error));
+    }
+
+    free(save->hashes.blocks);
+    save->hashes.blocks = NULL;
+
+    return true;
+}
+
+void begin_save() {
+    struct esave *save = &E.save;
+
+    // Binary files have no rows; saving would write an empty file.
+    if (E.hex.binary) {
+        set_message("Hex view is read-only");
+        return;
+    }
+
+    if (save->active) {
+        set_message("Save already in progress.");
+        return;
+    }
+
+    if (E.filename == NULL) {
+        E.filename = prompt("Save as: %s (ESC to cancel)", NULL);
+
+        if (E.filename == NULL) {
+            set_message("");
+            return;
+        }
+
+        select_syntax();
+    }
+
+    // Write through symlinks instead of replacing them.
+    char *path = realpath(E.filename, NULL);
+
+    if (path == NULL) {
+        path = strdup(E.filename);
+    }
+
+    char *tmp;
+    int32_t fd = open_temp_file(path, &tmp);
+
+    if (fd == -1) {
+        free(path);
+        set_message("Save failed: %s", strerror(errno));
+        return;
+    }
+
+    // The snapshot only holds the row buffers and packed blocks; rows are
+    // copied on write, and blocks outlive the save if they are unpacked.
+    save->id = (save->id == UINT32_MAX) ? 1 : save->id + 1;
+    save->rows = malloc(E.lines * sizeof(struct eslice));
+    save->lines = E.lines;
+    save->size = 0;
+    save->npacked = 0;
+
+    for (size_t i = 0; i < E.lines; i++) {
+        struct eblock *block = E.rows[i].block;
+
+        if (block && (i == 0 || E.rows[i - 1].block != block)) {
+            save->packed = realloc(save->packed, (save->npacked + 1) * sizeof(struct esave_block));
+            save->packed[save->npacked++] = (struct esave_block) { i, block };
+        }
+
+        save->rows[i].chars = block ? NULL : E.rows[i].chars;
+        save->rows[i].len = E.lens[i];
+        save->size += E.lens[i] + 1;
+        E.rows[i].snap = block ? 0 : save->id;
+    }
+
+    save->hashes = (struct ewatch_stream) {
+        .blocks = malloc(((save->size + NIM_WATCH_BLOCK - 1) / NIM_WATCH_BLOCK + 1) * sizeof(uint64_t)),
+        .hash = 0xcbf29ce484222325,
+    };
+    save->changes = E.changes;
+    journal_flush();
+
+    // A journal opened by the first edit during the save starts after its
+    // header; all of it comes after the snapshot.
+    E.journal.mark = (E.journal.fd == -1) ? sizeof(struct ejheader) : E.journal.size;
+    save->path = path;
+    save->tmp = tmp;
+    save->fd = fd;
+    save->error = 0;
+    atomic_store(&save->written, 0);
+    atomic_store(&save->done, false);
+    save->active = true;
+
+    int32_t error = pthread_create(&save->thread, NULL, save_worker, save);
+
+    if (error != 0) {
+        save->active = false;
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        free(path);
+        free(save->rows);
+        free(save->packed);
+        free(save->hashes.blocks);
+        save->rows = NULL;
+        save->packed = NULL;
+        save->hashes.blocks = NULL;
+        set_message("Save failed: %s", strerror(error));
+        return;
+    }
+
+    set_message("Saving %ld bytes...", save->size);
+}
+
+void save_file() {
+    PROFILE(P_SAVE_FILE, 'B');
+    begin_save();
+    PROFILE(P_SAVE_FILE, 'E');
+}
+
+bool poll_tasks() {
+    bool redraw = false;
+
+    if (time(NULL) - E.journal.flushed >= NIM_JOURNAL_DELAY) {
+        journal_flush();
+    }
+
+    if (finish_save(false)) {
+        redraw = true;
+    }
+
+    if (E.follow.active && follow_file(false)) {
+        redraw = true;
+    }
+
+    if (poll_stream()) {
+        redraw = true;
+    }
+
+    poll_background();
+
+    if (E_faulted) {
+        E_faulted = 0;
+        set_message("A mapped file was cut short on disk; its lost rows read as zeros");
+        redraw = true;
+    }
+
+    if (poll_grep()) {
+        redraw = true;
+    }
+
+    if (check_file()) {
+        redraw = true;
+    }
+
+    pack_cold_rows();
+
+    return redraw;
+}
+
+char *buffer_name() {
+    if (E.filename) {
+        return E.filename;
+    }
+
+    return E.results ? "[Results]" : "[No Name]";
+}
+
+// Makes buffer n current. Buffers never move, so the saves and streams
+// of the one put away keep running with valid pointers into it.
+void select_buffer(size_t n) {
+    uint8_t gw = E.gw;
+
+    E_buffer = S.buffers[n];
+    S.current = n;
+    S.w = S.w + gw - E.gw;
+}
+
+// Finishes the saves and drains the streams of the buffers put away. The
+// message bar keeps showing what the current buffer last reported.
+void poll_background() {
+    size_t current = S.current;
+    time_t timestamp = S.timestamp;
+    char message[sizeof(S.message)];
+
+    memcpy(message, S.message, sizeof(message));
+
+    for (size_t i = 0; i < S.nbuffers; i++) {
+        struct econfig *b = S.buffers[i];
+        bool saved = b->save.active && atomic_load(&b->save.done);
+
+        if (i == current || !(saved || b->stream.active)) {
+            continue;
+        }
+
+        select_buffer(i);
+
+        if (saved) {
+            finish_save(false);
+        }
+
+        poll_stream();
+        select_buffer(current);
+    }
+
+    memcpy(S.message, message, sizeof(message));
+    S.timestamp = timestamp;
+}
+
+void switch_buffer(size_t n) {
+    if (n == S.current) {
+        return;
+    }
+
+    journal_flush();
+    select_buffer(n);
+    set_message("Buffer %ld/%ld: %s", n + 1, S.nbuffers, buffer_name());
+}
+
+// Starts an empty buffer with the settings of the current one.
+void new_buffer() {
+    struct econfig *prev = E_buffer;
+
+    journal_flush();
+
+    S.buffers = realloc(S.buffers, (S.nbuffers + 1) * sizeof(struct econfig *));
+    S.buffers[S.nbuffers] = malloc(sizeof(struct econfig));
+    E_buffer = S.buffers[S.nbuffers];
+    S.current = S.nbuffers++;
+    S.w += prev->gw;
+
+    init_buffer();
+    E.lru.budget = prev->lru.budget;
+    E.pack.enabled = prev->pack.enabled;
+}
+
+// Opens filename in a new buffer, or switches to the buffer that already
+// has it.
+void open_buffer(char *filename) {
+    for (size_t i = 0; i < S.nbuffers; i++) {
+        char *name = S.buffers[i]->filename;
+
+        if (name && !strcmp(name, filename)) {
+            switch_buffer(i);
+            return;
+        }
+    }
+
+    if (access(filename, R_OK) == -1) {
+        set_message("Can't open %s: %s", filename, strerror(errno));
+        return;
+    }
+
+    bool journal = E.journal.enabled;
+    bool undo = E.undo.enabled;
+
+    new_buffer();
+    open_file(filename);
+
+    E.journal.enabled = journal;
+    E.undo.enabled = undo;
+}
+
+void start_open() {
+    char *query = prompt("Open: %s (ESC to cancel)", NULL);
+
+    if (query == NULL) {
+        return;
+    }
+
+    open_buffer(query);
+    free(query);
+}
+
+// Returns a buffer with unsaved changes, preferring the current one, or
+// S.nbuffers if there is none.
+size_t dirty_buffer() {
+    if (E.dirty) {
+        return S.current;
+    }
+
+    for (size_t i = 0; i < S.nbuffers; i++) {
+        if (S.buffers[i]->dirty) {
+            return i;
+        }
+    }
+
+    return S.nbuffers;
+}
+
+void close_buffers() {
+    for (size_t i = 0; i < S.nbuffers; i++) {
+        select_buffer(i);
+        finish_save(true);
+        journal_close(true);
+        watch_collect(true);
+
+        if (E.map) {
+            munmap(E.map, E.mapsize);
+            E.map = NULL;
+            E.mapsize = 0;
+        }
+    }
+}
+
+void find_next(char *query, uint16_t key) {
+    static ssize_t last_match = -1;
+    static int8_t direction = 1;
+
+    E.match.active = false;
+
+    if (key == ENTER || key == ESCAPE) {
+        last_match = -1;
+        direction = 1;
+        return;
+    }
+
+    if (key == ARROW_DOWN || key == ARROW_RIGHT) {
+        direction = 1;
+    } else if (key == ARROW_UP || key == ARROW_LEFT) {
+        direction = -1;
+    } else {
+        last_match = -1;
+        direction = 1;
+    }
+
+    if (last_match == -1) {
+        direction = 1;
+    }
+
+    ssize_t y = last_match;
+
+    for (size_t i = 0; i < E.lines; i++) {
+        y += direction;
+
+        if (y == -1) {
+            y = E.lines - 1;
+        } else if (y == (ssize_t) E.lines) {
+            y = 0;
+        }
+
+        struct erow *row = &E.rows[y];
+        ensure_row(y);
+
         char *match = strstr(row->render, query);
 
-        if (match) {
-            last_match = y;
-            E.y = y;
-            E.x = rx_to_x(row, match - row->render);
-            E.rowoff = E.lines;
+        if (match) {
+            last_match = y;
+            E.y = y;
+            E.x = render_to_x(y, match - row->render);
+            E.rowoff = E.lines;
+
+            E.match.active = true;
+            E.match.row = y;
+            E.match.start = match - row->render;
+            E.match.len = strlen(query);
+
+            break;
+        }
+    }
+}
+
+void find(char *query, uint16_t key) {
+    PROFILE(P_FIND, 'B');
+    find_next(query, key);
+    PROFILE(P_FIND, 'E');
+}
+
+void start_find() {
+    size_t x = E.x;
+    size_t y = E.y;
+    size_t rowoff = E.rowoff;
+    size_t coloff = E.coloff;
+    size_t lineoff = E.wrap.lineoff;
+
+    char *query = prompt("Find: %s (ESC to cancel, arrows to navigate)", find);
+
+    if (query == NULL) {
+        E.x = x;
+        E.y = y;
+        E.rowoff = rowoff;
+        E.coloff = coloff;
+        E.wrap.lineoff = lineoff;
+    }
+
+    free(query);
+}
+
+// Puts row n, counted from 1, a third of the way down the screen.
+void jump_to_line(size_t n) {
+    size_t above = S.h / 3;
+
+    E.y = (n == 0) ? 0 : ((n - 1 < E.lines) ? n - 1 : E.lines);
+    E.x = 0;
+
+    if (E.wrap.enabled) {
+        size_t line = wrap_prefix(E.y);
+        E.rowoff = wrap_locate((line > above) ? line - above : 0, &E.wrap.lineoff);
+    } else {
+        E.rowoff = (E.y > above) ? E.y - above : 0;
+    }
+}
+
+void start_jump() {
+    char *query = prompt("Go to line: %s (ESC to cancel)", NULL);
+
+    if (query == NULL) {
+        return;
+    }
+
+    char *end;
+    size_t n = strtoul(query, &end, 10);
+
+    if (*end != '\0') {
+        set_message("Not a line number: %s", query);
+    } else {
+        jump_to_line(n);
+    }
+
+    free(query);
+}
+
+void ab_append(struct abuf *ab, const char *s, size_t size) {
+    char *new = realloc(ab->buf, ab->size + size);
+
+    if (new == NULL) {
+        return;
+    }
+
+    memcpy(&new[ab->size], s, size);
+    ab->buf = new;
+    ab->size += size;
+}
+
+void ab_free(struct abuf *ab) {
+    free(ab->buf);
+}
+
+void grep_push(char *path) {
+    struct egrep *g = &S.grep;
+
+    pthread_mutex_lock(&g->lock);
+
+    if (g->npaths == g->cap) {
+        g->cap = g->cap ? g->cap * 2 : 256;
+        g->paths = realloc(g->paths, g->cap * sizeof(char *));
+    }
+
+    g->paths[g->npaths++] = path;
+    pthread_cond_signal(&g->ready);
+    pthread_mutex_unlock(&g->lock);
+}
+
+// Hidden files and directories, such as .git and the sidecars, are
+// skipped, and so are symbolic links.
+void grep_walk(char *dir) {
+    DIR *dp = opendir(dir);
+    struct dirent *de;
+
+    if (dp == NULL) {
+        return;
+    }
+
+    while ((de = readdir(dp)) != NULL) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+
+        bool top = !strcmp(dir, ".");
+        size_t size = strlen(dir) + strlen(de->d_name) + 2;
+        char *path = malloc(size);
+        snprintf(path, size, "%s%s%s", top ? "" : dir, top ? "" : "/", de->d_name);
+
+        uint8_t type = de->d_type;
+        struct stat st;
+
+        if (type == DT_UNKNOWN && lstat(path, &st) == 0) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+        }
+
+        if (type == DT_DIR) {
+            grep_walk(path);
+            free(path);
+        } else if (type == DT_REG) {
+            grep_push(path);
+        } else {
+            free(path);
+        }
+    }
+
+    closedir(dp);
+}
+
+void *grep_walker(void *arg) {
+    struct egrep *g = &S.grep;
+    (void) arg;
+
+    grep_walk(".");
+
+    pthread_mutex_lock(&g->lock);
+    g->walked = true;
+    pthread_cond_broadcast(&g->ready);
+    pthread_mutex_unlock(&g->lock);
+
+    return NULL;
+}
+
+// Finds the first match at or after pos. Literal patterns go straight to
+// memmem; expressions run on the mapped bytes with REG_STARTEND, so they
+// need neither a copy nor a terminating NUL.
+bool grep_match(char *map, size_t size, size_t pos, regex_t *re, size_t *at) {
+    if (re == NULL) {
+        char *match = memmem(&map[pos], size - pos, S.grep.pattern, S.grep.plen);
+
+        if (match == NULL) {
+            return false;
+        }
+
+        *at = match - map;
+        return true;
+    }
+
+    regmatch_t match = { .rm_so = pos, .rm_eo = size };
+
+    if (regexec(re, map, 1, &match, REG_STARTEND) != 0) {
+        return false;
+    }
+
+    *at = match.rm_so;
+    return true;
+}
+
+size_t count_lines(char *s, size_t len) {
+    size_t count = 0;
+    char *end = s + len;
+
+    while ((s = memchr(s, '\n', end - s)) != NULL) {
+        count++;
+        s++;
+    }
+
+    return count;
+}
+
+// Appends "path:line:text" for every matching line of the file, and
+// returns their number. Files with a NUL near the start are binary.
+// Files are read with pread in chunks of whole lines rather than mapped,
+// so a file truncated during the scan, like a rotated log, just ends
+// early instead of raising SIGBUS.
+size_t grep_file(char *path, regex_t *re, struct abuf *ab) {
+    int32_t fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    size_t cap = NIM_READ_CHUNK;
+    char *buf = malloc(cap);
+    size_t len = 0;
+    size_t offset = 0;
+    size_t line = 1;
+    size_t matches = 0;
+
+    while (true) {
+        // A line longer than the buffer doubles it.
+        if (len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+
+        ssize_t got = pread(fd, &buf[len], cap - len, offset);
+
+        if (got == -1) {
+            break;
+        }
+
+        bool eof = (got == 0);
+        len += got;
+
+        if (offset == 0 && memchr(buf, '\0', (len < NIM_BINARY_PROBE) ? len : NIM_BINARY_PROBE) != NULL) {
+            break;
+        }
+
+        offset += got;
+
+        char *last = memrchr(buf, '\n', len);
+        size_t limit = eof ? len : (last ? (size_t) (last - buf) + 1 : 0);
+        size_t pos = 0;
+        size_t at;
+
+        while (pos < limit && grep_match(buf, limit, pos, re, &at)) {
+            char *nl = memrchr(&buf[pos], '\n', at - pos);
+            size_t start = nl ? (size_t) (nl - buf) + 1 : pos;
+            nl = memchr(&buf[at], '\n', limit - at);
+            size_t end = nl ? (size_t) (nl - buf) : limit;
+
+            line += count_lines(&buf[pos], start - pos);
+
+            char num[24];
+            size_t numlen = snprintf(num, sizeof(num), ":%ld:", line);
+            ab_append(ab, path, strlen(path));
+            ab_append(ab, num, numlen);
+            ab_append(ab, &buf[start], (end - start < NIM_GREP_LINE) ? end - start : NIM_GREP_LINE);
+            ab_append(ab, "\n", 1);
+
+            matches++;
+            line++;
+            pos = end + 1;
+        }
+
+        if (pos < limit) {
+            line += count_lines(&buf[pos], limit - pos);
+        }
+
+        if (eof) {
+            break;
+        }
+
+        memmove(buf, &buf[limit], len - limit);
+        len -= limit;
+    }
+
+    free(buf);
+    close(fd);
+
+    return matches;
+}
+
+// Each worker compiles its own copy of the expression, since regexec
+// locks a shared one.
+void *grep_worker(void *arg) {
+    struct egrep *g = &S.grep;
+    struct abuf ab = ABUF_INIT;
+    regex_t re;
+    (void) arg;
+
+    if (g->regex) {
+        regcomp(&re, g->pattern, REG_EXTENDED | REG_NEWLINE);
+    }
+
+    while (true) {
+        pthread_mutex_lock(&g->lock);
+
+        while (g->next == g->npaths && !g->walked) {
+            pthread_cond_wait(&g->ready, &g->lock);
+        }
+
+        if (g->next == g->npaths) {
+            pthread_mutex_unlock(&g->lock);
+            break;
+        }
+
+        char *path = g->paths[g->next++];
+        pthread_mutex_unlock(&g->lock);
+
+        size_t matches = grep_file(path, g->regex ? &re : NULL, &ab);
+        free(path);
+
+        if (matches == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&g->lock);
+        ab_append(&g->out, ab.buf, ab.size);
+        g->matches += matches;
+        g->files++;
+        pthread_mutex_unlock(&g->lock);
+
+        ab.size = 0;
+    }
+
+    pthread_mutex_lock(&g->lock);
+
+    if (--g->running == 0) {
+        g->finish = now_us();
+    }
+
+    pthread_mutex_unlock(&g->lock);
+
+    if (g->regex) {
+        regfree(&re);
+    }
+
+    ab_free(&ab);
+    return NULL;
+}
+
+// Results go into a new buffer as they arrive. A pattern that starts with
+// a slash is an extended regular expression.
+void start_grep() {
+    struct egrep *g = &S.grep;
+
+    if (g->active) {
+        set_message("A search is already running");
+        return;
+    }
+
+    char *query = prompt("Search files: %s (ESC to cancel, /regex)", NULL);
+
+    if (query == NULL) {
+        return;
+    }
+
+    g->regex = (query[0] == '/' && query[1] != '\0');
+
+    if (g->regex) {
+        memmove(query, &query[1], strlen(query));
+
+        regex_t re;
+        int32_t error = regcomp(&re, query, REG_EXTENDED | REG_NEWLINE);
+
+        if (error != 0) {
+            char reason[80];
+            regerror(error, &re, reason, sizeof(reason));
+            set_message("Bad expression: %s", reason);
+            free(query);
+            return;
+        }
+
+        regfree(&re);
+    }
+
+    bool undo = E.undo.enabled;
+
+    new_buffer();
+    E.undo.enabled = undo;
+    E.results = true;
+
+    g->pattern = query;
+    g->plen = strlen(query);
+    g->buffer = S.current;
+    g->paths = NULL;
+    g->npaths = 0;
+    g->cap = 0;
+    g->next = 0;
+    g->walked = false;
+    g->out = (struct abuf) ABUF_INIT;
+    g->files = 0;
+    g->matches = 0;
+    g->start = now_us();
+    g->nworkers = worker_count();
+    g->running = g->nworkers;
+
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->ready, NULL);
+
+    if (pthread_create(&g->walker, NULL, grep_walker, NULL) != 0) {
+        die("pthread_create");
+    }
+
+    for (size_t i = 0; i < g->nworkers; i++) {
+        if (pthread_create(&g->workers[i], NULL, grep_worker, NULL) != 0) {
+            die("pthread_create");
+        }
+    }
+
+    g->active = true;
+    set_message("Searching for %s...", query);
+}
+
+// Moves finished results into the results buffer while it is current.
+bool poll_grep() {
+    struct egrep *g = &S.grep;
+    struct abuf out = ABUF_INIT;
+
+    if (!g->active) {
+        return false;
+    }
+
+    pthread_mutex_lock(&g->lock);
+
+    bool done = g->walked && g->running == 0;
+
+    if (S.current == g->buffer) {
+        out = g->out;
+        g->out = (struct abuf) ABUF_INIT;
+    }
+
+    bool pending = g->out.size > 0;
+    size_t matches = g->matches;
+    size_t files = g->files;
+    pthread_mutex_unlock(&g->lock);
+
+    bool redraw = out.size > 0;
+
+    if (redraw) {
+        append_bytes(out.buf, out.size);
+        ab_free(&out);
+    }
+
+    if (!done || pending) {
+        if (redraw) {
+            set_message("Searching for %s... %ld lines in %ld files", g->pattern, matches, files);
+        }
+
+        return redraw;
+    }
+
+    pthread_join(g->walker, NULL);
+
+    for (size_t i = 0; i < g->nworkers; i++) {
+        pthread_join(g->workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->ready);
+
+    set_message("%ld matching lines in %ld files (%.0f ms)", matches, files,
+            (g->finish - g->start) / 1000.0);
+
+    free(g->paths);
+    free(g->pattern);
+    g->active = false;
+
+    return true;
+}
+
+// Result rows read "path:line:text". Paths may contain colons, so the
+// path ends at the first colon that is followed by a number and a colon.
+void open_result() {
+    if (E.y >= E.lines) {
+        return;
+    }
+
+    unpack_row(E.y);
+
+    char *row = E.rows[E.y].chars;
+    size_t len = E.lens[E.y];
+
+    for (size_t i = 0; i < len; i++) {
+        size_t j = i + 1;
+
+        if (row[i] != ':') {
+            continue;
+        }
+
+        while (j < len && isdigit((uint8_t) row[j])) {
+            j++;
+        }
+
+        if (j == i + 1 || j == len || row[j] != ':') {
+            continue;
+        }
+
+        char *path = strndup(row, i);
+        size_t n = strtoul(&row[i + 1], NULL, 10);
+
+        open_buffer(path);
+
+        if (E.filename && !strcmp(E.filename, path)) {
+            jump_to_line(n);
+        }
+
+        free(path);
+        return;
+    }
+
+    set_message("Not a search result");
+}
+
+int compare_keys(const struct esort_key *a, const struct esort_key *b) {
+    if (a->prefix != b->prefix) {
+        return (a->prefix < b->prefix) ? -1 : 1;
+    }
+
+    size_t la = E.lens[a->idx];
+    size_t lb = E.lens[b->idx];
+    int cmp = memcmp(E.rows[a->idx].chars, E.rows[b->idx].chars, (la < lb) ? la : lb);
+
+    if (cmp != 0) {
+        return cmp;
+    }
+
+    return (la > lb) - (la < lb);
+}
+
+void merge_keys(struct esort_key *src, struct esort_key *dst, size_t lo, size_t mid, size_t hi) {
+    size_t i = lo;
+    size_t j = mid;
+    size_t k = lo;
+
+    while (i < mid && j < hi) {
+        dst[k++] = (compare_keys(&src[j], &src[i]) < 0) ? src[j++] : src[i++];
+    }
+
+    memcpy(&dst[k], &src[i], (mid - i) * sizeof(struct esort_key));
+    k += mid - i;
+    memcpy(&dst[k], &src[j], (hi - j) * sizeof(struct esort_key));
+}
+
+// A stable merge sort of keys[lo, hi), with tmp as scratch space.
+void sort_keys(struct esort_key *keys, struct esort_key *tmp, size_t lo, size_t hi) {
+    if (hi - lo <= NIM_SORT_SMALL) {
+        for (size_t i = lo + 1; i < hi; i++) {
+            struct esort_key key = keys[i];
+            size_t j = i;
+
+            while (j > lo && compare_keys(&key, &keys[j - 1]) < 0) {
+                keys[j] = keys[j - 1];
+                j--;
+            }
+
+            keys[j] = key;
+        }
+
+        return;
+    }
+
+    size_t mid = lo + (hi - lo) / 2;
+    sort_keys(keys, tmp, lo, mid);
+    sort_keys(keys, tmp, mid, hi);
+
+    // Already sorted input, common in dumps, needs no merge at all.
+    if (compare_keys(&keys[mid - 1], &keys[mid]) <= 0) {
+        return;
+    }
+
+    merge_keys(keys, tmp, lo, mid, hi);
+    memcpy(&keys[lo], &tmp[lo], (hi - lo) * sizeof(struct esort_key));
+}
+
+void *sort_worker(void *arg) {
+    struct esort_job *job = arg;
+    sort_keys(job->keys, job->tmp, job->lo, job->hi);
+
+    return NULL;
+}
+
+void *merge_worker(void *arg) {
+    struct esort_job *job = arg;
+    merge_keys(job->keys, job->tmp, job->lo, job->mid, job->hi);
+    memcpy(&job->keys[job->lo], &job->tmp[job->lo], (job->hi - job->lo) * sizeof(struct esort_key));
+
+    return NULL;
+}
+
+void run_sort_jobs(struct esort_job *jobs, size_t n, void *(*worker)(void *)) {
+    for (size_t i = 0; i < n; i++) {
+        jobs[i].started = (n > 1 && pthread_create(&jobs[i].thread, NULL, worker, &jobs[i]) == 0);
+
+        if (!jobs[i].started) {
+            worker(&jobs[i]);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (jobs[i].started) {
+            pthread_join(jobs[i].thread, NULL);
+        }
+    }
+}
+
+// Every core sorts one slice of the keys, then neighbouring slices are
+// merged in pairs, each pair on its own thread, until one run is left.
+void parallel_sort(struct esort_key *keys, size_t n) {
+    size_t k = (n >= NIM_SORT_PARALLEL) ? worker_count() : 1;
+    struct esort_key *tmp = malloc(n * sizeof(struct esort_key));
+    struct esort_job *jobs = calloc(k, sizeof(struct esort_job));
+    size_t *bounds = malloc((k + 1) * sizeof(size_t));
+
+    for (size_t i = 0; i <= k; i++) {
+        bounds[i] = n * i / k;
+    }
+
+    for (size_t i = 0; i < k; i++) {
+        jobs[i] = (struct esort_job) { .keys = keys, .tmp = tmp, .lo = bounds[i], .hi = bounds[i + 1] };
+    }
+
+    run_sort_jobs(jobs, k, sort_worker);
+
+    for (size_t width = 1; width < k; width *= 2) {
+        size_t m = 0;
+
+        for (size_t i = 0; i + width < k; i += 2 * width) {
+            size_t end = (i + 2 * width < k) ? i + 2 * width : k;
+            jobs[m++] = (struct esort_job) {
+                .keys = keys, .tmp = tmp, .lo = bounds[i], .mid = bounds[i + width], .hi = bounds[end],
+            };
+        }
+
+        run_sort_jobs(jobs, m, merge_worker);
+    }
+
+    free(bounds);
+    free(jobs);
+    free(tmp);
+}
+
+struct esort_key *sort_rows(size_t lo, size_t hi) {
+    size_t n = hi - lo;
+    struct esort_key *keys = malloc((n ? n : 1) * sizeof(struct esort_key));
+
+    for (size_t i = 0; i < n; i++) {
+        size_t y = lo + i;
+        uint64_t prefix = 0;
+
+        unpack_row(y);
+
+        for (size_t j = 0; j < 8; j++) {
+            prefix = (prefix << 8) | ((j < E.lens[y]) ? (uint8_t) E.rows[y].chars[j] : 0);
+        }
+
+        keys[i] = (struct esort_key) { prefix, y };
+    }
+
+    parallel_sort(keys, n);
+
+    return keys;
+}
+
+// Puts rows [lo, hi) in the order of the keys in one pass, keeping only
+// the first of equal rows if unique is set. Rows move together with their
+// text and caches, and dropped rows are freed.
+size_t reorder_rows(size_t lo, size_t hi, struct esort_key *keys, bool unique) {
+    struct ewrap *w = &E.wrap;
+    size_t n = hi - lo;
+    struct erow *rows = malloc((n ? n : 1) * sizeof(struct erow));
+    size_t *lens = malloc((n ? n : 1) * sizeof(size_t));
+    uint32_t *counts = w->enabled ? malloc((n ? n : 1) * sizeof(uint32_t)) : NULL;
+    uint8_t *stamps = w->enabled ? malloc((n ? n : 1) * sizeof(uint8_t)) : NULL;
+    size_t m = 0;
+    size_t kept = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        size_t y = keys[i].idx;
+
+        if (unique && m > 0 && compare_keys(&keys[i], &keys[kept]) == 0) {
+            free_row(&E.rows[y]);
+            continue;
+        }
+
+        kept = i;
+        rows[m] = E.rows[y];
+        lens[m] = E.lens[y];
+
+        if (w->enabled) {
+            counts[m] = w->counts[y];
+            stamps[m] = w->stamps[y];
+        }
+
+        m++;
+    }
+
+    size_t tail = E.lines - hi;
+    memmove(&E.rows[lo + m], &E.rows[hi], tail * sizeof(struct erow));
+    memmove(&E.lens[lo + m], &E.lens[hi], tail * sizeof(size_t));
+    memmove(&E.comments[lo + m], &E.comments[hi], tail * sizeof(bool));
+    memcpy(&E.rows[lo], rows, m * sizeof(struct erow));
+    memcpy(&E.lens[lo], lens, m * sizeof(size_t));
+
+    if (w->enabled) {
+        memmove(&w->counts[lo + m], &w->counts[hi], tail * sizeof(uint32_t));
+        memmove(&w->stamps[lo + m], &w->stamps[hi], tail * sizeof(uint8_t));
+        memcpy(&w->counts[lo], counts, m * sizeof(uint32_t));
+        memcpy(&w->stamps[lo], stamps, m * sizeof(uint8_t));
+        w->dirty = (lo < w->dirty) ? lo : w->dirty;
+    }
+
+    // The queue forgets the range and learns its rows at their new places.
+    lru_shift(lo, -(ssize_t) n);
+    lru_shift(lo, m);
+    partial_shift(lo, -(ssize_t) n);
+    partial_shift(lo, m);
+    E.lines -= n - m;
+
+    for (size_t y = lo; y < lo + m; y++) {
+        E.comments[y] = false;
+
+        if (E.syntax) {
+            drop_render(&E.rows[y]);
+        } else if (E.rows[y].render && E.lru.budget > 0) {
+            lru_push(y, E.rows[y].used);
+        }
+    }
+
+    // Multi-line comments depend on the rows above, which are different
+    // now: highlight the range in order, then follow the comment state
+    // below it until it settles.
+    if (syntax_chains()) {
+        for (size_t y = lo; y < lo + m; y++) {
+            ensure_row(y);
+        }
+
+        if (lo + m < E.lines) {
+            if (E.rows[lo + m].render == NULL) {
+                render_row(lo + m);
+            }
+
+            update_syntax(lo + m);
+        }
+    }
+
+    free(rows);
+    free(lens);
+    free(counts);
+    free(stamps);
+
+    return m;
+}
+
+int compare_groups(const void *a, const void *b) {
+    const struct esort_group *x = a;
+    const struct esort_group *y = b;
+
+    if (x->count != y->count) {
+        return (x->count < y->count) ? 1 : -1;
+    }
+
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+// Replaces rows [lo, hi) with one "count value" row per distinct value,
+// most frequent first.
+size_t count_rows(size_t lo, size_t hi, struct esort_key *keys) {
+    size_t n = hi - lo;
+    size_t ngroups = 0;
+    struct esort_group *groups = malloc((n ? n : 1) * sizeof(struct esort_group));
+
+    for (size_t i = 0; i < n; i++) {
+        if (ngroups > 0 && compare_keys(&keys[i], &keys[groups[ngroups - 1].start]) == 0) {
+            groups[ngroups - 1].count++;
+        } else {
+            groups[ngroups++] = (struct esort_group) { i, 1 };
+        }
+    }
+
+    qsort(groups, ngroups, sizeof(struct esort_group), compare_groups);
+
+    struct abuf ab = ABUF_INIT;
+    size_t *ends = malloc((ngroups ? ngroups : 1) * sizeof(size_t));
+
+    for (size_t i = 0; i < ngroups; i++) {
+        size_t y = keys[groups[i].start].idx;
+        char num[24];
+        size_t len = snprintf(num, sizeof(num), "%7ld ", groups[i].count);
+
+        ab_append(&ab, num, len);
+        ab_append(&ab, E.rows[y].chars, E.lens[y]);
+        ends[i] = ab.size;
+    }
+
+    struct eslice *rows = malloc((ngroups ? ngroups : 1) * sizeof(struct eslice));
+
+    for (size_t i = 0, start = 0; i < ngroups; i++) {
+        rows[i] = (struct eslice) { &ab.buf[start], ends[i] - start };
+        start = ends[i];
+    }
+
+    remove_rows(lo, n);
+    splice_rows(lo, rows, ngroups);
+
+    free(rows);
+    free(ends);
+    free(groups);
+    ab_free(&ab);
 
-            line = y;
-            hl = malloc(row->rlen);
-            memcpy(hl, row->hl, row->rlen);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+    return ngroups;
+}
 
-            break;
+// Runs "sort", "uniq" or "count" over rows [lo, hi). Sort and uniq move
+// the rows themselves; count writes new ones. The replaced rows go into
+// one undo group as deletions followed by insertions, unless they would
+// crowd everything else out of the undo log, and the journal only keeps
+// the command, which gives the same rows when it is replayed.
+bool apply_command(char *name, size_t lo, size_t hi) {
+    bool sort = !strcmp(name, "sort");
+    bool unique = !strcmp(name, "uniq");
+    bool count = !strcmp(name, "count");
+
+    if (!sort && !unique && !count) {
+        return false;
+    }
+
+    finish_save(true);
+
+    uint64_t start = now_us();
+    size_t n = hi - lo;
+    size_t bytes = 0;
+
+    for (size_t y = lo; y < hi; y++) {
+        bytes += E.lens[y];
+    }
+
+    // Count rows are at most the value and a number longer than the rows.
+    bool undoable = E.undo.enabled && 2 * bytes + n * 64 <= E.undo.limit / 2;
+
+    undo_begin();
+
+    for (size_t y = lo; y < hi && undoable; y++) {
+        unpack_row(y);
+        undo_record(J_DELETE_ROW, lo, 0, E.rows[y].chars, E.lens[y]);
+    }
+
+    struct esort_key *keys = sort_rows(lo, hi);
+    size_t m = count ? count_rows(lo, hi, keys) : reorder_rows(lo, hi, keys, unique);
+    free(keys);
+
+    for (size_t y = lo; y < lo + m && undoable; y++) {
+        unpack_row(y);
+        undo_record(J_INSERT_ROW, y, 0, E.rows[y].chars, E.lens[y]);
+    }
+
+    if (!undoable) {
+        undo_clear();
+    }
+
+    undo_end();
+    journal_record(J_COMMAND, lo, hi, name, strlen(name));
+
+    if (E.filter.active) {
+        build_filter();
+
+        if (E.filter.count > 0) {
+            size_t pos = filter_find(E.y);
+            E.y = E.filter.rows[(pos < E.filter.count) ? pos : E.filter.count - 1];
         }
     }
+
+    mark_dirty();
+    update_gutter();
+
+    if (E.y > E.lines) {
+        E.y = E.lines;
+    }
+
+    if (E.y < E.lines && E.x > E.lens[E.y]) {
+        E.x = E.lens[E.y];
+    }
+
+    set_message("%s: %ld rows into %ld in %.0f ms%s", name, n, m, (now_us() - start) / 1000.0,
+            undoable ? "" : " (too large to undo)");
+
+    return true;
 }
 
-void start_find() {
-    size_t x = E.x;
-    size_t y = E.y;
-    size_t rowoff = E.rowoff;
-    size_t coloff = E.coloff;
+// Runs a command over the whole buffer, or over the rows in a range like
+// "10-200".
+void run_command(char *name, char *range) {
+    size_t lo = 0;
+    size_t hi = E.lines;
 
-    char *query = prompt("Find: %s (ESC to cancel, arrows to navigate)", find);
+    if (range && *range) {
+        char *end;
+        size_t from = strtoul(range, &end, 10);
+        size_t to = 0;
+
+        if (*end == '-') {
+            to = strtoul(end + 1, &end, 10);
+        }
+
+        if (*end != '\0' || from == 0 || to < from) {
+            set_message("Not a line range: %s (use FROM-TO)", range);
+            return;
+        }
+
+        lo = (from - 1 < E.lines) ? from - 1 : E.lines;
+        hi = (to < E.lines) ? to : E.lines;
+    }
+
+    if (!apply_command(name, lo, hi)) {
+        set_message("Unknown command: %s", name);
+    }
+}
+
+void start_command() {
+    char *query = prompt("Command: %s (sort, uniq or count, all lines or FROM-TO; ESC to cancel)", NULL);
 
     if (query == NULL) {
-        E.x = x;
-        E.y = y;
-        E.rowoff = rowoff;
-        E.coloff = coloff;
+        return;
+    }
+
+    char *range = strchr(query, ' ');
+
+    if (range) {
+        *range++ = '\0';
     }
 
+    run_command(query, range);
     free(query);
 }
 
-void ab_append(struct abuf *ab, const char *s, size_t size) {
-    char *new = realloc(ab->buf, ab->size + size);
+// Formats the row holding offset at like hexdump -C and returns its length.
+size_t hex_row(char *line, size_t at) {
+    static const char digits[] = "0123456789abcdef";
+    struct ehex *h = &E.hex;
+    size_t len = 0;
 
-    if (new == NULL) {
+    for (int8_t shift = (h->digits - 1) * 4; shift >= 0; shift -= 4) {
+        line[len++] = digits[(at >> shift) & 15];
+    }
+
+    line[len++] = ' ';
+
+    for (size_t i = 0; i < NIM_HEX_WIDTH; i++) {
+        uint8_t c = (at + i < h->size) ? h->map[at + i] : 0;
+        bool valid = (at + i < h->size);
+
+        if (i % 8 == 0) {
+            line[len++] = ' ';
+        }
+
+        line[len++] = valid ? digits[c >> 4] : ' ';
+        line[len++] = valid ? digits[c & 15] : ' ';
+        line[len++] = ' ';
+    }
+
+    line[len++] = ' ';
+    line[len++] = '|';
+
+    for (size_t i = 0; i < NIM_HEX_WIDTH && at + i < h->size; i++) {
+        uint8_t c = h->map[at + i];
+        line[len++] = (c >= 32 && c < 127) ? c : '.';
+    }
+
+    line[len++] = '|';
+
+    return len;
+}
+
+// Screen column of the cursor byte within its row.
+size_t hex_column() {
+    size_t i = E.hex.pos % NIM_HEX_WIDTH;
+
+    return E.hex.digits + 2 + i * 3 + i / 8;
+}
+
+void draw_hex(struct abuf *ab) {
+    struct ehex *h = &E.hex;
+    size_t width = S.w + E.gw;
+    char line[128];
+
+    for (uint16_t y = 0; y < S.h; y++) {
+        size_t at = (h->rowoff + y) * NIM_HEX_WIDTH;
+
+        if (at < h->size || at == 0) {
+            size_t len = hex_row(line, at);
+            ab_append(ab, line, (len < width) ? len : width);
+        } else {
+            ab_append(ab, "~", 1);
+        }
+
+        ab_append(ab, "\x1b[K\r\n", 5);
+    }
+}
+
+void hex_scroll() {
+    struct ehex *h = &E.hex;
+    size_t row = h->pos / NIM_HEX_WIDTH;
+
+    if (row < h->rowoff) {
+        h->rowoff = row;
+    } else if (row >= h->rowoff + S.h) {
+        h->rowoff = row - S.h + 1;
+    }
+}
+
+// Offsets may be given in decimal or, with 0x, in hexadecimal.
+void seek_hex() {
+    struct ehex *h = &E.hex;
+    char *query = prompt("Go to offset: %s (ESC to cancel)", NULL);
+
+    if (query == NULL) {
         return;
     }
 
-    memcpy(&new[ab->size], s, size);
-    ab->buf = new;
-    ab->size += size;
+    char *end;
+    size_t offset = strtoull(query, &end, 0);
+
+    if (*end != '\0') {
+        set_message("Not an offset: %s", query);
+    } else {
+        size_t row = offset / NIM_HEX_WIDTH;
+        size_t above = S.h / 3;
+
+        h->pos = (offset < h->size) ? offset : (h->size ? h->size - 1 : 0);
+        h->rowoff = (row > above) ? row - above : 0;
+    }
+
+    free(query);
 }
 
-void ab_free(struct abuf *ab) {
-    free(ab->buf);
+// Maps the file of the current buffer. The view shows the file as it is
+// on disk, without unsaved changes.
+void toggle_hex() {
+    struct ehex *h = &E.hex;
+
+    if (h->active) {
+        if (h->binary) {
+            set_message("Binary files have no text view");
+            return;
+        }
+
+        if (h->map) {
+            munmap(h->map, h->size);
+        }
+
+        h->active = false;
+        set_message("Hex view off");
+        return;
+    }
+
+    int32_t fd = E.filename ? open(E.filename, O_RDONLY) : -1;
+
+    if (fd == -1) {
+        set_message("Hex view needs a file on disk");
+        return;
+    }
+
+    if (!map_hex(fd)) {
+        set_message("Can't map %s: %s", E.filename, strerror(errno));
+    } else {
+        set_message("Hex view of %s on disk (Ctrl-B for text)", E.filename);
+    }
+
+    close(fd);
+}
+
+// Moves through the hex view. Keys that would change the buffer are
+// refused; the rest return false and work as usual.
+bool hex_key(uint16_t c) {
+    struct ehex *h = &E.hex;
+    size_t last = h->size ? h->size - 1 : 0;
+    size_t page = (size_t) S.h * NIM_HEX_WIDTH;
+
+    switch (c) {
+        case CTRL_KEY('q'):
+        case CTRL_KEY('p'):
+        case CTRL_KEY('o'):
+        case CTRL_KEY('n'):
+        case CTRL_KEY('r'):
+        case CTRL_KEY('b'):
+        case CTRL_KEY('l'):
+        case ESCAPE:
+            return false;
+
+        case ARROW_UP:
+            h->pos -= (h->pos >= NIM_HEX_WIDTH) ? NIM_HEX_WIDTH : 0;
+            break;
+
+        case ARROW_DOWN:
+            h->pos = (last - h->pos >= NIM_HEX_WIDTH) ? h->pos + NIM_HEX_WIDTH : last;
+            break;
+
+        case ARROW_LEFT:
+            h->pos -= (h->pos > 0) ? 1 : 0;
+            break;
+
+        case ARROW_RIGHT:
+            h->pos += (h->pos < last) ? 1 : 0;
+            break;
+
+        case HOME:
+            h->pos -= h->pos % NIM_HEX_WIDTH;
+            break;
+
+        case END:
+            h->pos += NIM_HEX_WIDTH - 1 - h->pos % NIM_HEX_WIDTH;
+            h->pos = (h->pos < last) ? h->pos : last;
+            break;
+
+        case PAGE_UP:
+            h->pos = (h->pos >= page) ? h->pos - page : h->pos % NIM_HEX_WIDTH;
+            break;
+
+        case PAGE_DOWN:
+            h->pos = (last - h->pos >= page) ? h->pos + page : last;
+            break;
+
+        case CTRL_KEY('g'):
+            seek_hex();
+            break;
+
+        // Text files in the hex view are saved from their rows as usual.
+        case CTRL_KEY('s'):
+            if (!h->binary) {
+                return false;
+            }
+
+            set_message("Hex view is read-only");
+            break;
+
+        default:
+            set_message("Hex view is read-only");
+            break;
+    }
+
+    return true;
+}
+
+// While filtering, rowoff is still the row at the top of the screen. The
+// cursor row is always shown, even when find or undo moved it elsewhere.
+void filter_scroll() {
+    struct efilter *f = &E.filter;
+
+    if (E.y < E.lines) {
+        filter_add(E.y);
+    }
+
+    size_t top = filter_find(E.rowoff);
+    size_t pos = filter_find(E.y);
+
+    if (pos < top) {
+        E.rowoff = E.y;
+    } else if (pos >= top + S.h) {
+        E.rowoff = f->rows[pos - S.h + 1];
+    }
+
+    f->cy = pos - filter_find(E.rowoff);
+}
+
+void filter_page(bool down) {
+    struct efilter *f = &E.filter;
+    size_t pos = filter_find(E.y);
+
+    if (f->count == 0) {
+        return;
+    }
+
+    pos = down ? pos + S.h : ((pos > S.h) ? pos - S.h : 0);
+    E.y = f->rows[(pos < f->count) ? pos : f->count - 1];
+}
+
+void start_filter() {
+    if (E.filter.active) {
+        clear_filter();
+        set_message("Filter off");
+        return;
+    }
+
+    char *query = prompt("Filter: %s (ESC to cancel)", NULL);
+
+    if (query == NULL) {
+        return;
+    }
+
+    if (E.wrap.enabled) {
+        toggle_wrap();
+    }
+
+    E.filter.active = true;
+    E.filter.pattern = query;
+    E.filter.plen = strlen(query);
+
+    uint64_t start = now_us();
+    build_filter();
+
+    set_message("%ld matching lines in %.1f ms (Ctrl-E to show all)",
+            E.filter.count, (now_us() - start) / 1000.0);
+
+    if (E.filter.count > 0) {
+        size_t pos = filter_find(E.y);
+        E.y = E.filter.rows[(pos < E.filter.count) ? pos : E.filter.count - 1];
+        E.x = 0;
+    }
 }
 
 void scroll_screen() {
+    if (E.hex.active) {
+        hex_scroll();
+        return;
+    }
+
     E.rx = 0;
 
     if (E.y < E.lines) {
-        E.rx = x_to_rx(&E.rows[E.y], E.x);
+        E.rx = x_to_rx(E.y, E.x);
+    }
+
+    if (E.wrap.enabled) {
+        wrap_scroll();
+        return;
     }
 
-    if (E.y < E.rowoff) {
+    if (E.filter.active) {
+        filter_scroll();
+    } else if (E.y < E.rowoff) {
         E.rowoff = E.y;
+    } else if (E.y >= E.rowoff + S.h) {
+        E.rowoff = E.y - S.h + 1;
+    }
+
+    if (E.rx < E.coloff) {
+        E.coloff = E.rx;
+    }
+
+    if (E.rx >= E.coloff + S.w) {
+        E.coloff = E.rx - S.w + 1;
+    }
+}
+
+void draw_gutter(struct abuf *ab, size_t y) {
+    if (E.gw == 0) {
+        return;
+    }
+
+    char gutter[E.gw + 1];
+
+    if (y < E.lines && NIM_NUMLINES) {
+        snprintf(gutter, sizeof(gutter), "%*ld ", E.gw - 1, y + 1);
+    } else {
+        memset(gutter, ' ', E.gw);
+    }
+
+    ab_append(ab, "\x1b[90m", 5);
+    ab_append(ab, gutter, E.gw);
+    ab_append(ab, "\x1b[39m", 5);
+}
+
+void draw_run(struct abuf *ab, char *c, size_t len, uint8_t hl, int16_t *curr_color) {
+    int16_t color = (hl == HL_NORMAL) ? -1 : syntax_to_color(hl);
+    char buf[16];
+
+    if (color != *curr_color) {
+        if (color == -1) {
+            ab_append(ab, "\x1b[39m", 5);
+        } else {
+            size_t clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+            ab_append(ab, buf, clen);
+        }
+
+        *curr_color = color;
+    }
+
+    size_t start = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (!iscntrl((uint8_t) c[i])) {
+            continue;
+        }
+
+        char sym = (c[i] <= 26) ? '@' + c[i] : '?';
+        ab_append(ab, &c[start], i - start);
+        ab_append(ab, "\x1b[7m", 4);
+        ab_append(ab, &sym, 1);
+        ab_append(ab, "\x1b[m", 3);
+
+        if (color != -1) {
+            size_t clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+            ab_append(ab, buf, clen);
+        }
+
+        start = i + 1;
+    }
+
+    ab_append(ab, &c[start], len - start);
+}
+
+// Draws the part of a row from screen column coloff that fits the screen.
+void draw_row(struct abuf *ab, size_t idx, size_t coloff) {
+    struct erow *row = &E.rows[idx];
+    ensure_row(idx);
+
+    ssize_t len = row->rlen - coloff;
+
+    if (len < 0) {
+        len = 0;
+    } else if (len > S.w) {
+        len = S.w;
+    }
+
+    size_t pos = coloff;
+    size_t end = coloff + len;
+
+    // Columns and render offsets differ; a wide character cut by
+    // the left edge is drawn as spaces, and dropped at the right.
+    if (row->cells) {
+        size_t rx = offsetof(struct ecell, rx);
+        size_t first = find_cell(row, rx, coloff);
+        size_t last = find_cell(row, rx, coloff + S.w);
+
+        if (row->cells[first].rx < coloff && first + 1 < row->ncells) {
+            first++;
+
+            for (size_t i = coloff; i < row->cells[first].rx; i++) {
+                ab_append(ab, " ", 1);
+            }
+        }
+
+        pos = row->cells[first].r;
+        end = (last > first) ? row->cells[last].r : pos;
     }
 
-    if (E.y >= E.rowoff + E.h) {
-        E.rowoff = E.y - E.h + 1;
+    size_t s = 0;
+    int16_t curr_color = -1;
+    bool overlay = (E.match.active && E.match.row == idx);
+
+    while (s < row->nspans && row->spans[s].start + row->spans[s].len <= pos) {
+        s++;
     }
 
-    if (E.rx < E.coloff) {
-        E.coloff = E.rx;
-    }
+    // Each run ends where a span, the gap before it or the match ends.
+    while (pos < end) {
+        uint8_t hl = HL_NORMAL;
+        size_t stop = end;
+
+        if (s < row->nspans) {
+            struct espan *span = &row->spans[s];
+            size_t edge = (span->start <= pos) ? span->start + span->len : span->start;
+
+            if (span->start <= pos) {
+                hl = span->hl;
+            }
+
+            if (edge < stop) {
+                stop = edge;
+            }
+        }
 
-    if (E.rx >= E.coloff + E.w) {
-        E.coloff = E.rx - E.w + 1;
-    }
-}
+        if (overlay) {
+            size_t mstart = E.match.start;
+            size_t mend = E.match.start + E.match.len;
 
-void draw_gutter(struct abuf *ab, struct erow *row) {
-    if (E.gw == 0) {
-        return;
-    }
+            if (mstart <= pos && pos < mend) {
+                hl = HL_MATCH;
+                stop = (mend < stop) ? mend : stop;
+            } else if (pos < mstart && mstart < stop) {
+                stop = mstart;
+            }
+        }
 
-    char gutter[E.gw + 1];
+        draw_run(ab, &row->render[pos], stop - pos, hl, &curr_color);
+        pos = stop;
 
-    if (row && NIM_NUMLINES) {
-        snprintf(gutter, sizeof(gutter), "%*ld ", E.gw - 1, row->idx + 1);
+        while (s < row->nspans && row->spans[s].start + row->spans[s].len <= pos) {
+            s++;
+        }
     }
 
-    ab_append(ab, "\x1b[90m", 5);
-    ab_append(ab, gutter, E.gw);
     ab_append(ab, "\x1b[39m", 5);
 }
 
 void draw_lines(struct abuf *ab) {
+    PROFILE(P_DRAW_LINES, 'B');
+
     char welcome[80];
     size_t len = snprintf(welcome, sizeof(welcome), "Nim (%s)", NIM_VERSION);
 
-    if (len > E.w) {
-        len = E.w;
+    if (len > S.w) {
+        len = S.w;
+    }
+
+    if (E.hex.active) {
+        draw_hex(ab);
+        PROFILE(P_DRAW_LINES, 'E');
+        return;
     }
 
-    for (uint16_t y = 0; y < E.h; y++) {
-        size_t idx = y + E.rowoff;
+    size_t pos = E.filter.active ? filter_find(E.rowoff) : 0;
+    size_t idx = E.filter.active ? filter_row(pos) : E.rowoff;
+    size_t sub = E.wrap.enabled ? E.wrap.lineoff : 0;
+    size_t start = E.wrap.enabled ? wrap_start(idx, sub) : E.coloff;
+
+    // The rows on screen are marked before any is rendered, so rendering
+    // one that is missing cannot evict another that is about to be drawn.
+    E.lru.frame = E.lru.tick;
+    E.lru.drawn = UINT64_MAX;
+
+    for (size_t y = 0, i = idx, p = pos; y < S.h && i < E.lines; y++) {
+        if (E.rows[i].render) {
+            E.rows[i].used = ++E.lru.tick;
+        }
+
+        i = E.filter.active ? filter_row(++p) : i + 1;
+    }
 
+    for (uint16_t y = 0; y < S.h; y++) {
         if (idx >= E.lines) {
-            draw_gutter(ab, NULL);
+            draw_gutter(ab, idx);
 
-            if (E.lines == 0 && y == E.h / 3) {
-                size_t padding = (E.w - len) / 2;
+            if (E.lines == 0 && y == S.h / 3) {
+                size_t padding = (S.w - len) / 2;
 
                 if (padding > 0) {
                     ab_append(ab, "~", 1);
@@ -947,60 +6948,49 @@ void draw_lines(struct abuf *ab) {
                 ab_append(ab, "~", 1);
             }
         } else {
-            struct erow *row = &E.rows[idx];
-            draw_gutter(ab, row);
-
-            ssize_t len = row->rlen - E.coloff;
-
-            if (len < 0) {
-                len = 0;
-            } else if (len > E.w) {
-                len = E.w;
-            }
+            // Continuation lines of a wrapped row have an empty gutter.
+            draw_gutter(ab, (sub == 0) ? idx : E.lines);
+            draw_row(ab, idx, start);
+        }
 
-            char *c = &row->render[E.coloff];
-            uint8_t *hl = &row->hl[E.coloff];
-            int16_t curr_color = -1;
+        ab_append(ab, "\x1b[K\r\n", 5);
 
-            for (ssize_t i = 0; i < len; i++) {
-                if (iscntrl(c[i])) {
-                    char sym = (c[i] <= 26) ? '@' + c[i] : '?';
-                    ab_append(ab, "\x1b[7m", 4);
-                    ab_append(ab, &sym, 1);
-                    ab_append(ab, "\x1b[m", 3);
+        if (E.wrap.enabled && idx < E.lines && ++sub < wrap_count(idx)) {
+            start = wrap_next(idx, start);
+        } else {
+            idx = E.filter.active ? filter_row(++pos) : idx + 1;
+            sub = 0;
+            start = E.wrap.enabled ? 0 : E.coloff;
+        }
+    }
 
-                    if (curr_color != -1) {
-                        char buf[16];
-                        size_t clen = snprintf(buf, sizeof(buf), "\x1b[%dm", curr_color);
-                        ab_append(ab, buf, clen);
-                    }
-                } else if (hl[i] == HL_NORMAL) {
-                    if (curr_color != -1) {
-                        ab_append(ab, "\x1b[39m", 5);
-                        curr_color = -1;
-                    }
+    E.lru.drawn = E.lru.tick;
+    PROFILE(P_DRAW_LINES, 'E');
+}
 
-                    ab_append(ab, &c[i], 1);
-                } else {
-                    uint8_t color = syntax_to_color(hl[i]);
+int compare_frames(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
 
-                    if (color != curr_color) {
-                        curr_color = color;
+    return (x > y) - (x < y);
+}
 
-                        char buf[16];
-                        size_t clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        ab_append(ab, buf, clen);
-                    }
+// Frame times are those of the frames already on screen; the syntax time
+// and row count belong to the last key that changed the buffer.
+size_t draw_hud(char *buf, size_t size) {
+    struct ehud *h = &S.hud;
+    uint64_t sorted[NIM_HUD_FRAMES];
+    uint64_t last = h->frames[(h->head + NIM_HUD_FRAMES - 1) % NIM_HUD_FRAMES];
 
-                    ab_append(ab, &c[i], 1);
-                }
-            }
+    memcpy(sorted, h->frames, h->nframes * sizeof(uint64_t));
+    qsort(sorted, h->nframes, sizeof(uint64_t), compare_frames);
 
-            ab_append(ab, "\x1b[39m", 5);
-        }
+    uint64_t p99 = h->nframes ? sorted[(h->nframes - 1) * 99 / 100] : 0;
+    struct mallinfo2 mi = mallinfo2();
 
-        ab_append(ab, "\x1b[K\r\n", 5);
-    }
+    return snprintf(buf, size, "frame %.2f/%.2fms p99 | %.1fK out | syntax %.2fms %ld rows | heap %.1fM",
+            last / 1000.0, p99 / 1000.0, h->bytes / 1024.0, h->edit_us / 1000.0, h->edit_rows,
+            (mi.uordblks + mi.hblkhd) / 1048576.0);
 }
 
 void draw_status_bar(struct abuf *ab) {
@@ -1010,19 +7000,64 @@ void draw_status_bar(struct abuf *ab) {
     char meta[80];
 
     size_t len = snprintf(status, sizeof(status), "%.20s - %ld lines%s",
-            E.filename ? E.filename : "[No Name]", E.lines,
+            buffer_name(), E.lines,
             E.dirty ? " (modified)" : "");
-    size_t mlen = snprintf(meta, sizeof(meta), "%s | %ld/%ld",
+
+    if (E.filter.active) {
+        len = snprintf(status, sizeof(status), "%.20s - %ld/%ld lines &%.20s%s",
+                buffer_name(), E.filter.count, E.lines,
+                E.filter.pattern, E.dirty ? " (modified)" : "");
+    }
+
+    if (E.hex.active) {
+        len = snprintf(status, sizeof(status), "%.20s - %ld bytes (hex)%s",
+                buffer_name(), E.hex.size, E.dirty ? " (modified)" : "");
+    }
+
+    char usage[40] = "";
+    size_t ulen = 0;
+
+    if (S.nbuffers > 1) {
+        ulen += snprintf(usage, sizeof(usage), "%ld/%ld | ", S.current + 1, S.nbuffers);
+        ulen = (ulen < sizeof(usage)) ? ulen : sizeof(usage) - 1;
+    }
+
+    if (E.lru.budget > 0) {
+        ulen += snprintf(&usage[ulen], sizeof(usage) - ulen, "%.1f/%.1fM | ",
+                E.lru.resident / 1048576.0, E.lru.budget / 1048576.0);
+        ulen = (ulen < sizeof(usage)) ? ulen : sizeof(usage) - 1;
+    }
+
+    if (E.pack.size > 0) {
+        snprintf(&usage[ulen], sizeof(usage) - ulen, "%.1fx | ",
+                (double) E.pack.raw / E.pack.size);
+    }
+
+    size_t mlen = snprintf(meta, sizeof(meta), "%s%s | %ld/%ld", usage,
             E.syntax ? E.syntax->filetype : "no ft", E.y + 1, E.lines);
 
-    if (len > E.gw + E.w) {
-        len = E.gw + E.w;
+    if (E.hex.active) {
+        mlen = snprintf(meta, sizeof(meta), "%s0x%lx/0x%lx", usage, E.hex.pos, E.hex.size);
+    }
+
+    // The HUD takes the right-hand side, cut to the room the name leaves.
+    if (S.hud.active) {
+        mlen = draw_hud(meta, sizeof(meta));
+        mlen = (mlen < sizeof(meta)) ? mlen : sizeof(meta) - 1;
+
+        if (len + 1 + mlen > E.gw + S.w) {
+            mlen = (E.gw + S.w > len + 1) ? E.gw + S.w - len - 1 : 0;
+        }
+    }
+
+    if (len > E.gw + S.w) {
+        len = E.gw + S.w;
     }
 
     ab_append(ab, status, len);
 
-    while (len < E.gw + E.w) {
-        if (E.gw + E.w - len == mlen) {
+    while (len < E.gw + S.w) {
+        if (E.gw + S.w - len == mlen) {
             ab_append(ab, meta, mlen);
             break;
         }
@@ -1037,46 +7072,93 @@ void draw_status_bar(struct abuf *ab) {
 void draw_message_bar(struct abuf *ab) {
     ab_append(ab, "\x1b[K", 3);
 
-    size_t len = strlen(E.message);
+    size_t len = strlen(S.message);
 
-    if (len > E.gw + E.w) {
-        len = E.gw + E.w;
+    if (len > E.gw + S.w) {
+        len = E.gw + S.w;
     }
 
-    if (len && time(NULL) - E.timestamp < 5) {
-        ab_append(ab, E.message, len);
+    if (len && time(NULL) - S.timestamp < 5) {
+        ab_append(ab, S.message, len);
     }
 }
 
-void refresh_screen() {
-    scroll_screen();
+void draw_frame(struct abuf *ab) {
+    ab_append(ab, "\x1b[?25l\x1b[H", 9);
 
-    struct abuf ab = ABUF_INIT;
-    ab_append(&ab, "\x1b[?25l\x1b[H", 9);
+    draw_lines(ab);
+    draw_status_bar(ab);
+    draw_message_bar(ab);
+
+    size_t cy = E.y - E.rowoff;
+
+    if (E.wrap.enabled) {
+        cy = E.wrap.cy;
+    } else if (E.filter.active) {
+        cy = E.filter.cy;
+    }
+
+    size_t cx = (E.wrap.enabled ? E.wrap.cx : E.rx - E.coloff) + E.gw;
 
-    draw_lines(&ab);
-    draw_status_bar(&ab);
-    draw_message_bar(&ab);
+    if (E.hex.active) {
+        cy = E.hex.pos / NIM_HEX_WIDTH - E.hex.rowoff;
+        cx = hex_column();
+    }
 
     char buf[32];
-    size_t num = snprintf(buf, sizeof(buf), "\x1b[%ld;%ldH",
-            (E.y - E.rowoff) + 1, (E.rx - E.coloff) + E.gw + 1);
-    ab_append(&ab, buf, num);
+    size_t num = snprintf(buf, sizeof(buf), "\x1b[%ld;%ldH", cy + 1, cx + 1);
+    ab_append(ab, buf, num);
+
+    ab_append(ab, "\x1b[?25h", 6);
+}
 
-    ab_append(&ab, "\x1b[?25h", 6);
+// Frames are written without blocking. While the terminal is still busy
+// with the previous one, new frames are skipped and only the latest state
+// is drawn once it catches up.
+void refresh_screen() {
+    // Keys like page down depend on the scroll position, dropped or not.
+    scroll_screen();
 
-    write(STDOUT_FILENO, ab.buf, ab.size);
-    ab_free(&ab);
+    if (S.output.len > 0 && !flush_output()) {
+        S.output.stale = true;
+        return;
+    }
+
+    uint64_t start = now_us();
+
+    // Terminals that support synchronized updates show the frame at once.
+    struct abuf ab = ABUF_INIT;
+    ab_append(&ab, "\x1b[?2026h", 8);
+    draw_frame(&ab);
+    ab_append(&ab, "\x1b[?2026l", 8);
+
+    S.output.buf = ab.buf;
+    S.output.len = ab.size;
+    S.output.off = 0;
+    S.output.stale = false;
+    flush_output();
+
+    uint64_t us = now_us() - start;
+    struct ehud *h = &S.hud;
+
+    h->frames[h->head] = us;
+    h->head = (h->head + 1) % NIM_HUD_FRAMES;
+    h->nframes += (h->nframes < NIM_HUD_FRAMES);
+    h->bytes = ab.size;
+
+    if (S.trace.out) {
+        record_frame(us);
+    }
 }
 
 void set_message(const char *fmt, ...) {
     va_list args;
 
     va_start(args, fmt);
-    vsnprintf(E.message, sizeof(E.message), fmt, args);
+    vsnprintf(S.message, sizeof(S.message), fmt, args);
     va_end(args);
 
-    E.timestamp = time(NULL);
+    S.timestamp = time(NULL);
 }
 
 char *prompt(char *message, void (*callback)(char *, uint16_t)) {
@@ -1113,7 +7195,7 @@ char *prompt(char *message, void (*callback)(char *, uint16_t)) {
 
                 return buf;
             }
-        } else if (!iscntrl(key) && key < 128) {
+        } else if (!iscntrl(key) && key < 256) {
             if (len == size - 1) {
                 size *= 2;
                 buf = realloc(buf, size);
@@ -1130,59 +7212,78 @@ char *prompt(char *message, void (*callback)(char *, uint16_t)) {
 }
 
 void move_cursor(uint16_t key) {
-    struct erow *row = (E.y < E.lines) ? &E.rows[E.y] : NULL;
+    bool in_row = (E.y < E.lines);
 
     switch (key) {
         case ARROW_UP:
-            if (E.y > 0) {
-                E.y--;
+            if (E.wrap.enabled) {
+                wrap_move(false);
+            } else if (E.y > 0) {
+                E.y = row_above(E.y);
             }
 
             break;
 
         case ARROW_DOWN:
-            if (E.y < E.lines) {
-                E.y++;
+            if (E.wrap.enabled) {
+                wrap_move(true);
+            } else if (E.y < E.lines) {
+                E.y = row_below(E.y);
             }
 
             break;
 
         case ARROW_LEFT:
             if (E.x > 0) {
-                E.x--;
-            } else if (E.y > 0) {
-                E.y--;
-                E.x = E.rows[E.y].len;
+                E.x = cell_x(E.y, E.x - 1);
+            } else if (E.y > 0 && row_above(E.y) != E.y) {
+                E.y = row_above(E.y);
+                E.x = E.lens[E.y];
             }
 
             break;
 
         case ARROW_RIGHT:
-            if (row && E.x < row->len) {
-                E.x++;
-            } else if (row && E.x == row->len) {
-                E.y++;
+            if (in_row && E.x < E.lens[E.y]) {
+                E.x = next_x(E.y, E.x);
+            } else if (in_row && E.x == E.lens[E.y] && row_below(E.y) != E.y) {
+                E.y = row_below(E.y);
                 E.x = 0;
             }
 
             break;
     }
 
-    row = (E.y < E.lines) ? &E.rows[E.y] : NULL;
-    size_t len = row ? row->len : 0;
+    size_t len = (E.y < E.lines) ? E.lens[E.y] : 0;
 
     if (E.x > len) {
         E.x = len;
+    } else if (E.x > 0 && E.x < len) {
+        // Moving between rows can land inside a multibyte character.
+        E.x = cell_x(E.y, E.x);
     }
 }
 
-void process_key() {
+void handle_key(uint16_t c) {
     static uint8_t quit_times = NIM_QUIT_TIMES;
-    uint16_t c = read_key();
+
+    if (E.hex.active && hex_key(c)) {
+        quit_times = NIM_QUIT_TIMES;
+        return;
+    }
+
+    undo_begin();
+    S.hud.syntax_us = 0;
+    S.hud.syntax_rows = 0;
 
     switch (c) {
         case ENTER:
-            insert_newline();
+            if (E.results) {
+                open_result();
+            } else {
+                insert_newline();
+            }
+
             break;
 
         case BACKSPACE:
@@ -1196,13 +7297,17 @@ void process_key() {
             break;
 
         case CTRL_KEY('q'):
-            if (E.dirty && quit_times > 0) {
+            finish_save(true);
+
+            if (dirty_buffer() < S.nbuffers && quit_times > 0) {
+                switch_buffer(dirty_buffer());
                 set_message("WARNING! File has unsaved changes (%d more time%s...)",
                         quit_times, quit_times > 1 ? "s" : "");
                 quit_times--;
                 return;
             }
 
+            close_buffers();
             clear_screen();
             exit(0);
             break;
@@ -1215,6 +7320,54 @@ void process_key() {
             start_find();
             break;
 
+        case CTRL_KEY('z'):
+            undo(false);
+            break;
+
+        case CTRL_KEY('y'):
+            undo(true);
+            break;
+
+        case CTRL_KEY('t'):
+            start_follow();
+            break;
+
+        case CTRL_KEY('p'):
+            S.hud.active = !S.hud.active;
+            break;
+
+        case CTRL_KEY('w'):
+            toggle_wrap();
+            break;
+
+        case CTRL_KEY('g'):
+            start_jump();
+            break;
+
+        case CTRL_KEY('e'):
+            start_filter();
+            break;
+
+        case CTRL_KEY('o'):
+            start_open();
+            break;
+
+        case CTRL_KEY('n'):
+            switch_buffer((S.current + 1) % S.nbuffers);
+            break;
+
+        case CTRL_KEY('r'):
+            start_grep();
+            break;
+
+        case CTRL_KEY('b'):
+            toggle_hex();
+            break;
+
+        case CTRL_KEY('x'):
+            start_command();
+            break;
+
         case ARROW_UP:
         case ARROW_DOWN:
         case ARROW_LEFT:
@@ -1228,24 +7381,34 @@ void process_key() {
 
         case END:
             if (E.y < E.lines) {
-                E.x = E.rows[E.y].len;
+                E.x = E.lens[E.y];
             }
             break;
 
         case PAGE_UP:
         case PAGE_DOWN:
+            if (E.wrap.enabled) {
+                wrap_page(c == PAGE_DOWN);
+                break;
+            }
+
+            if (E.filter.active) {
+                filter_page(c == PAGE_DOWN);
+                break;
+            }
+
             {
                 if (c == PAGE_UP) {
                     E.y = E.rowoff;
                 } else if (c == PAGE_DOWN) {
-                    E.y = E.rowoff + E.h - 1;
+                    E.y = E.rowoff + S.h - 1;
 
                     if (E.y > E.lines) {
                         E.y = E.lines;
                     }
                 }
 
-                int rows = E.h;
+                int rows = S.h;
                 while (rows--) {
                     move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
                 }
@@ -1262,40 +7425,502 @@ void process_key() {
             break;
     }
 
+    undo_end();
     quit_times = NIM_QUIT_TIMES;
+
+    if (S.hud.syntax_rows > 0) {
+        S.hud.edit_us = S.hud.syntax_us;
+        S.hud.edit_rows = S.hud.syntax_rows;
+    }
 }
 
-void init() {
+void process_key() {
+    PROFILE(P_PROCESS_KEY, 'B');
+    handle_key(read_key());
+    PROFILE(P_PROCESS_KEY, 'E');
+}
+
+void on_signal(int sig) {
+    E_signal = sig;
+}
+
+void on_resize(int sig) {
+    (void) sig;
+    E_resized = 1;
+}
+
+// Rows loaded from the index borrow their text from a mapping of the
+// file, and reading a page past the end of a file that another process
+// cut short raises SIGBUS. The page is replaced with zeros, which is all
+// a read of it would return now, and the next poll says so.
+void on_fault(int sig, siginfo_t *info, void *context) {
+    (void) context;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    void *addr = (void *) ((uintptr_t) info->si_addr & ~(page - 1));
+
+    if (info->si_code != BUS_ADRERR || mmap(addr, page, PROT_READ,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        signal(sig, SIG_DFL);
+        return;
+    }
+
+    E_faulted = 1;
+}
+
+void init_buffer() {
     E.x = 0;
     E.y = 0;
     E.gw = 0;
     E.rx = 0;
     E.filename = NULL;
     E.dirty = false;
+    E.changes = 0;
     E.rows = NULL;
+    E.lens = NULL;
+    E.comments = NULL;
     E.lines = 0;
+    E.capacity = 0;
+    E.partial = SIZE_MAX;
+    E.map = NULL;
+    E.mapsize = 0;
     E.rowoff = 0;
     E.coloff = 0;
-    E.message[0] = '\0';
-    E.timestamp = 0;
     E.syntax = NULL;
+    E.save.active = false;
+    E.save.id = 0;
+    E.save.rows = NULL;
+    E.save.packed = NULL;
+    E.save.hashes.blocks = NULL;
+    E.save.npacked = 0;
+    E.save.orphans = NULL;
+    E.save.norphans = 0;
+    E.journal.enabled = false;
+    E.journal.stale = false;
+    E.journal.fd = -1;
+    E.journal.path = NULL;
+    E.journal.size = 0;
+    E.journal.mark = 0;
+    E.journal.buf = NULL;
+    E.journal.len = 0;
+    E.journal.cap = 0;
+    E.undo.enabled = false;
+    E.undo.applying = false;
+    E.undo.fresh = true;
+    E.undo.buf = NULL;
+    E.undo.size = 0;
+    E.undo.cap = 0;
+    E.undo.pos = 0;
+    E.undo.limit = NIM_UNDO_LIMIT;
+    E.undo.group = 0;
+    E.follow.active = false;
+    E.follow.offset = 0;
+    E.stream.active = false;
+    E.lru.entries = NULL;
+    E.lru.head = 0;
+    E.lru.count = 0;
+    E.lru.cap = 0;
+    E.lru.nshifts = 0;
+    E.lru.base = 0;
+    E.lru.budget = 0;
+    E.lru.resident = 0;
+    E.lru.tick = 0;
+    E.lru.frame = 0;
+    E.lru.drawn = 0;
+    E.match.active = false;
+    E.pack.enabled = false;
+    E.wrap.enabled = false;
+    E.wrap.counts = NULL;
+    E.wrap.stamps = NULL;
+    E.wrap.tree = NULL;
+    E.wrap.lineoff = 0;
+    E.filter.active = false;
+    E.filter.pattern = NULL;
+    E.filter.rows = NULL;
+    E.filter.count = 0;
+    E.filter.cap = 0;
+    E.results = false;
+    E.hex.active = false;
+    E.hex.binary = false;
+    E.hex.map = NULL;
+    E.hex.size = 0;
+    E.watch.size = 0;
+    E.watch.hash = 0;
+    E.watch.blocks = NULL;
+    E.watch.nblocks = 0;
+    E.watch.hasher = NULL;
+    E.watch.checked = 0;
+    E.watch.warned = false;
+    E.pack.idle = false;
+    E.pack.trim = false;
+    E.pack.next = 0;
+    E.pack.rowoff = 0;
+    E.pack.size = 0;
+    E.pack.raw = 0;
+}
 
-    if (get_screen_size(&E.h, &E.w) == -1) {
+void init() {
+    S.buffers = malloc(sizeof(struct econfig *));
+    S.buffers[0] = malloc(sizeof(struct econfig));
+    S.nbuffers = 1;
+    S.current = 0;
+    E_buffer = S.buffers[0];
+
+    init_buffer();
+    S.message[0] = '\0';
+    S.timestamp = 0;
+    S.trace.out = NULL;
+    S.trace.in = NULL;
+    S.trace.path = NULL;
+    S.trace.realtime = false;
+    S.trace.start = 0;
+    S.trace.keys = 0;
+    S.trace.frames = 0;
+    S.trace.slowest = 0;
+    S.trace.slowest_key = 0;
+    S.profile.events = NULL;
+    S.profile.head = 0;
+    S.profile.count = 0;
+    S.profile.path = NULL;
+    S.output.fd = STDOUT_FILENO;
+    S.output.buf = NULL;
+    S.output.len = 0;
+    S.output.off = 0;
+    S.output.stale = false;
+    S.hud.active = false;
+    S.hud.nframes = 0;
+    S.hud.head = 0;
+    S.hud.bytes = 0;
+    S.hud.syntax_us = 0;
+    S.hud.syntax_rows = 0;
+    S.hud.edit_us = 0;
+    S.hud.edit_rows = 0;
+    S.headless = false;
+    S.grep.active = false;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    sa.sa_handler = on_resize;
+    sigaction(SIGWINCH, &sa, NULL);
+
+    sa.sa_sigaction = on_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+void init_screen() {
+    if (S.headless) {
+        S.w = 80;
+        S.h = 24;
+    } else if (get_screen_size(&S.h, &S.w) == -1) {
         die("get_size");
     }
 
-    E.h -= 2;
+    // Frames go through a separate non-blocking description of the terminal,
+    // so reads on stdin keep their timeout.
+    char *tty = S.headless ? NULL : ttyname(STDOUT_FILENO);
+    int32_t fd = tty ? open(tty, O_WRONLY | O_NONBLOCK | O_NOCTTY) : -1;
+
+    if (fd != -1) {
+        S.output.fd = fd;
+    }
+
+    S.h -= 2;
+}
+
+// Only the window size is asked for; wrap counts catch up as rows are drawn.
+void resize_screen() {
+    struct winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col <= E.gw || ws.ws_row < 3) {
+        return;
+    }
+
+    S.w = ws.ws_col - E.gw;
+    S.h = ws.ws_row - 2;
+}
+
+struct escript_key {
+    char *name;
+    uint16_t key;
+};
+
+struct escript_key script_keys[] = {
+    { "enter", ENTER },
+    { "backspace", BACKSPACE },
+    { "delete", DELETE },
+    { "up", ARROW_UP },
+    { "down", ARROW_DOWN },
+    { "left", ARROW_LEFT },
+    { "right", ARROW_RIGHT },
+    { "home", HOME },
+    { "end", END },
+    { "pageup", PAGE_UP },
+    { "pagedown", PAGE_DOWN },
+    { "undo", CTRL_KEY('z') },
+    { "redo", CTRL_KEY('y') },
+};
+
+#define SCRIPT_KEYS (sizeof(script_keys) / sizeof(script_keys[0]))
+
+void script_error(char *path, size_t line, char *message) {
+    fprintf(stderr, "%s:%ld: %s\n", path, line, message);
+    exit(1);
+}
+
+// Runs one command per line without a terminal:
+//   type TEXT, find TEXT, goto LINE, save, sort/uniq/count [FROM-TO],
+//   enter, backspace, delete, up, down, left, right, home, end,
+//   pageup, pagedown, undo and redo, each with an optional count.
+// Calls step, if given, after every single operation. Returns the number
+// of operations performed.
+size_t run_script(char *path, void (*step)()) {
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        die("fopen");
+    }
+
+    char *buf = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    size_t line = 0;
+    size_t ops = 0;
+
+    while ((len = getline(&buf, &cap, fp)) != -1) {
+        line++;
+
+        while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) {
+            buf[--len] = '\0';
+        }
+
+        if (len == 0 || buf[0] == '#') {
+            continue;
+        }
+
+        char *arg = strchr(buf, ' ');
+
+        if (arg) {
+            *arg++ = '\0';
+        }
+
+        if (!strcmp(buf, "type") && arg) {
+            undo_begin();
+
+            for (char *c = arg; *c; c++) {
+                insert_char((uint8_t) *c);
+
+                if (step) {
+                    step();
+                }
+            }
+
+            undo_end();
+            scroll_screen();
+            ops += strlen(arg);
+            continue;
+        } else if (!strcmp(buf, "find") && arg) {
+            find(arg, ARROW_DOWN);
+            ops++;
+        } else if (!strcmp(buf, "goto") && arg) {
+            jump_to_line(strtoul(arg, NULL, 10));
+            ops++;
+        } else if (!strcmp(buf, "sort") || !strcmp(buf, "uniq") || !strcmp(buf, "count")) {
+            run_command(buf, arg);
+            ops++;
+        } else if (!strcmp(buf, "save")) {
+            if (E.filename == NULL) {
+                script_error(path, line, "no file name");
+            }
+
+            save_file();
+            finish_save(true);
+
+            if (E.dirty) {
+                script_error(path, line, S.message);
+            }
+
+            ops++;
+        } else {
+            size_t k = 0;
+
+            while (k < SCRIPT_KEYS && strcmp(buf, script_keys[k].name)) {
+                k++;
+            }
+
+            if (k == SCRIPT_KEYS) {
+                script_error(path, line, "unknown command");
+            }
+
+            size_t count = arg ? strtoul(arg, NULL, 10) : 1;
+
+            for (size_t i = 0; i < count; i++) {
+                handle_key(script_keys[k].key);
+                scroll_screen();
+
+                if (step) {
+                    step();
+                }
+            }
+
+            ops += count;
+            continue;
+        }
+
+        scroll_screen();
+
+        if (step) {
+            step();
+        }
+    }
+
+    free(buf);
+    fclose(fp);
+
+    return ops;
 }
 
+void usage() {
+    fprintf(stderr, "Usage: nim [-b megabytes] [-z] [--script commands] [--record trace]\n"
+            "           [--replay trace [--realtime]] [--profile json] [file... | -]\n");
+    exit(1);
+}
+
+#ifndef NIM_NO_MAIN
 int main(int argc, char **argv) {
+    static struct option options[] = {
+        { "script", required_argument, NULL, 's' },
+        { "record", required_argument, NULL, 'r' },
+        { "replay", required_argument, NULL, 'p' },
+        { "realtime", no_argument, NULL, 'R' },
+        { "profile", required_argument, NULL, 'P' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    size_t budget = 0;
+    bool pack = false;
+    char *script = NULL;
+    char *record = NULL;
+    char *replay = NULL;
+    char *profile = NULL;
+    bool realtime = false;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "b:p:P:r:Rs:z", options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                budget = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                break;
+
+            case 'p':
+                replay = optarg;
+                break;
+
+            case 'P':
+                profile = optarg;
+                break;
+
+            case 'r':
+                record = optarg;
+                break;
+
+            case 'R':
+                realtime = true;
+                break;
+
+            case 's':
+                script = optarg;
+                break;
+
+            case 'z':
+                pack = true;
+                break;
+
+            default:
+                usage();
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    bool piped = (argc >= 2 && !strcmp(argv[1], "-"));
+
+    if (script) {
+        init();
+        S.headless = true;
+        init_screen();
+
+        if (argc >= 2 && !piped) {
+            open_file(argv[1]);
+        }
+
+        E.undo.enabled = true;
+
+        struct timespec start;
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        size_t ops = run_script(script, NULL);
+        finish_save(true);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        printf("%ld ops in %.3f s (%.0f ops/sec)%s\n", ops, elapsed,
+                elapsed > 0 ? ops / elapsed : 0.0, E.dirty ? ", unsaved changes" : "");
+        close_buffers();
+
+        return 0;
+    }
+
+    int32_t input = piped ? take_stdin() : -1;
+
+    // Runs after the terminal is restored, so the summary stays visible.
+    atexit(finish_trace);
+
     enable_raw_mode();
     init();
 
-    if (argc >= 2) {
+    if (replay) {
+        S.trace.realtime = realtime;
+        start_replay(replay);
+    } else {
+        init_screen();
+
+        if (record) {
+            start_recording(record);
+        }
+    }
+
+    E.lru.budget = budget;
+    E.pack.enabled = pack;
+
+    if (profile) {
+        start_profile(profile);
+    }
+
+    set_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-Z/Y = undo/redo");
+
+    if (piped) {
+        open_stream(input);
+    } else if (argc >= 2) {
         open_file(argv[1]);
     }
 
-    set_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    E.journal.enabled = (S.trace.in == NULL);
+    E.undo.enabled = true;
+
+    if (!piped && argc > 2) {
+        for (int i = 2; i < argc; i++) {
+            open_buffer(argv[i]);
+        }
+
+        switch_buffer(0);
+    }
 
     while (true) {
         refresh_screen();
@@ -1304,3 +7929,5 @@ int main(int argc, char **argv) {
 
     return 0;
 }
+
+#endif